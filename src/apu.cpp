@@ -0,0 +1,347 @@
+#include "apu.h"
+#include "save_state.h"
+
+#include <algorithm>
+
+//Bits that always read back as 1, indexed from 0xFF10
+static const std::uint8_t READ_MASKS[0x30] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, //NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, //NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, //NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, //NR40-NR44
+    0x00, 0x00, 0x70,             //NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 //Wave pattern RAM
+};
+
+static const std::uint8_t DUTY_WAVEFORMS[4] = {
+    0b00000001, //12.5%
+    0b10000001, //25%
+    0b10000111, //50%
+    0b01111110, //75%
+};
+
+static const int NOISE_DIVISORS[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+void Apu::Envelope::trigger(std::uint8_t nrx2)
+{
+    volume = nrx2 >> 4;
+    timer = nrx2 & 0x7;
+}
+
+void Apu::Envelope::clock(std::uint8_t nrx2)
+{
+    const auto period = nrx2 & 0x7;
+    if (period == 0 || --timer > 0)
+    {
+        return;
+    }
+
+    timer = period;
+
+    if ((nrx2 & 0x08) && volume < 15)
+    {
+        ++volume;
+    }
+    else if ( ! (nrx2 & 0x08) && volume > 0)
+    {
+        --volume;
+    }
+}
+
+void Apu::Channel::clock_length(std::uint8_t nrx4)
+{
+    if ((nrx4 & 0x40) && length > 0 && --length == 0)
+    {
+        enabled = false;
+    }
+}
+
+std::uint8_t Apu::read(std::uint16_t address) const
+{
+    if (address == 0xFF26)
+    {
+        return (nr(0xFF26) & 0x80) | 0x70
+             | (square[0].enabled ? 0x1 : 0)
+             | (square[1].enabled ? 0x2 : 0)
+             | (wave.enabled      ? 0x4 : 0)
+             | (noise.enabled     ? 0x8 : 0);
+    }
+
+    return nr(address) | READ_MASKS[address - 0xFF10];
+}
+
+void Apu::write(std::uint16_t address, std::uint8_t value)
+{
+    //$FF30	$FF3F	Wave pattern RAM is writable even when powered off
+    if (0xFF30 <= address)
+    {
+        nr(address) = value;
+        return;
+    }
+
+    //NR52 - Sound on/off
+    if (address == 0xFF26)
+    {
+        if ( ! (value & 0x80))
+        {
+            std::fill(registers, registers + 0x20, 0);
+            square[0].enabled = square[1].enabled = wave.enabled = noise.enabled = false;
+        }
+        nr(0xFF26) = value & 0x80;
+        return;
+    }
+
+    if ( ! (nr(0xFF26) & 0x80))
+    {
+        return;
+    }
+
+    nr(address) = value;
+
+    switch (address)
+    {
+        //Length timers
+        case 0xFF11: square[0].length = 64 - (value & 0x3F); return;
+        case 0xFF16: square[1].length = 64 - (value & 0x3F); return;
+        case 0xFF1B: wave.length = 256 - value; return;
+        case 0xFF20: noise.length = 64 - (value & 0x3F); return;
+
+        //Turning a DAC off also disables its channel
+        case 0xFF12: if ( ! (value & 0xF8)) square[0].enabled = false; return;
+        case 0xFF17: if ( ! (value & 0xF8)) square[1].enabled = false; return;
+        case 0xFF1A: if ( ! (value & 0x80)) wave.enabled = false; return;
+        case 0xFF21: if ( ! (value & 0xF8)) noise.enabled = false; return;
+
+        //Triggers
+        case 0xFF14: if (value & 0x80) trigger(0); return;
+        case 0xFF19: if (value & 0x80) trigger(1); return;
+        case 0xFF1E: if (value & 0x80) trigger(2); return;
+        case 0xFF23: if (value & 0x80) trigger(3); return;
+    }
+}
+
+void Apu::trigger(int channel)
+{
+    if (channel < 2)
+    {
+        const std::uint16_t base = 0xFF10 + 5*channel;
+        const int frequency = nr(base+3) | (nr(base+4) & 0x7) << 8;
+
+        auto &ch = square[channel];
+        ch.enabled = nr(base+2) & 0xF8;
+        if (ch.length == 0)
+        {
+            ch.length = 64;
+        }
+        ch.timer = (2048 - frequency) * 4;
+        ch.envelope.trigger(nr(base+2));
+
+        if (channel == 0)
+        {
+            const auto nr10 = nr(0xFF10);
+            const auto period = (nr10 >> 4) & 0x7;
+            ch.shadow_frequency = frequency;
+            ch.sweep_timer = period ? period : 8;
+            ch.sweep_enabled = period || (nr10 & 0x7);
+            if (nr10 & 0x7)
+            {
+                sweep_calculate();
+            }
+        }
+    }
+    else if (channel == 2)
+    {
+        const int frequency = nr(0xFF1D) | (nr(0xFF1E) & 0x7) << 8;
+
+        wave.enabled = nr(0xFF1A) & 0x80;
+        if (wave.length == 0)
+        {
+            wave.length = 256;
+        }
+        wave.timer = (2048 - frequency) * 2;
+        wave.position = 0;
+    }
+    else
+    {
+        const auto nr43 = nr(0xFF22);
+
+        noise.enabled = nr(0xFF21) & 0xF8;
+        if (noise.length == 0)
+        {
+            noise.length = 64;
+        }
+        noise.timer = NOISE_DIVISORS[nr43 & 0x7] << (nr43 >> 4);
+        noise.envelope.trigger(nr(0xFF21));
+        noise.lfsr = 0x7FFF;
+    }
+}
+
+int Apu::sweep_calculate()
+{
+    const auto nr10 = nr(0xFF10);
+    auto &ch = square[0];
+
+    const int delta = ch.shadow_frequency >> (nr10 & 0x7);
+    const int frequency = (nr10 & 0x08)
+            ? ch.shadow_frequency - delta
+            : ch.shadow_frequency + delta;
+
+    if (frequency > 2047)
+    {
+        ch.enabled = false;
+    }
+
+    return frequency;
+}
+
+//512 Hz: length on even steps, sweep on 2 and 6, envelope on 7
+void Apu::clock_frame_sequencer()
+{
+    if ((frame_sequencer_step & 1) == 0)
+    {
+        square[0].clock_length(nr(0xFF14));
+        square[1].clock_length(nr(0xFF19));
+        wave.clock_length(nr(0xFF1E));
+        noise.clock_length(nr(0xFF23));
+    }
+
+    if (frame_sequencer_step == 2 || frame_sequencer_step == 6)
+    {
+        const auto nr10 = nr(0xFF10);
+        const auto period = (nr10 >> 4) & 0x7;
+        auto &ch = square[0];
+
+        if (--ch.sweep_timer <= 0)
+        {
+            ch.sweep_timer = period ? period : 8;
+
+            if (ch.sweep_enabled && period)
+            {
+                const auto frequency = sweep_calculate();
+                if (frequency <= 2047 && (nr10 & 0x7))
+                {
+                    ch.shadow_frequency = frequency;
+                    nr(0xFF13) = frequency & 0xFF;
+                    nr(0xFF14) = (nr(0xFF14) & ~0x7) | (frequency >> 8);
+                    sweep_calculate();
+                }
+            }
+        }
+    }
+
+    if (frame_sequencer_step == 7)
+    {
+        square[0].envelope.clock(nr(0xFF12));
+        square[1].envelope.clock(nr(0xFF17));
+        noise.envelope.clock(nr(0xFF21));
+    }
+
+    frame_sequencer_step = (frame_sequencer_step + 1) & 0x7;
+}
+
+void Apu::run_once()
+{
+    if (nr(0xFF26) & 0x80)
+    {
+        if (++frame_sequencer_ticks == CPU_CLOCK / 512)
+        {
+            frame_sequencer_ticks = 0;
+            clock_frame_sequencer();
+        }
+
+        for (int i=0; i<2; ++i)
+        {
+            auto &ch = square[i];
+            if (--ch.timer <= 0)
+            {
+                const std::uint16_t base = 0xFF10 + 5*i;
+                ch.timer = (2048 - (nr(base+3) | (nr(base+4) & 0x7) << 8)) * 4;
+                ch.duty_step = (ch.duty_step + 1) & 0x7;
+            }
+        }
+
+        if (--wave.timer <= 0)
+        {
+            wave.timer = (2048 - (nr(0xFF1D) | (nr(0xFF1E) & 0x7) << 8)) * 2;
+            wave.position = (wave.position + 1) & 0x1F;
+        }
+
+        if (--noise.timer <= 0)
+        {
+            const auto nr43 = nr(0xFF22);
+            noise.timer = NOISE_DIVISORS[nr43 & 0x7] << (nr43 >> 4);
+
+            const std::uint16_t bit = (noise.lfsr ^ (noise.lfsr >> 1)) & 1;
+            noise.lfsr = (noise.lfsr >> 1) | (bit << 14);
+            if (nr43 & 0x08)
+            {
+                noise.lfsr = (noise.lfsr & ~0x40) | (bit << 6);
+            }
+        }
+    }
+
+    sample_clock += SAMPLE_RATE;
+    if (sample_clock >= CPU_CLOCK)
+    {
+        sample_clock -= CPU_CLOCK;
+        if (sample_output_enabled)
+        {
+            mix_sample();
+        }
+    }
+}
+
+void Apu::mix_sample()
+{
+    //Each DAC maps its 0-15 input to -15..15, silent channels contribute 0
+    int outputs[4] = {0};
+
+    for (int i=0; i<2; ++i)
+    {
+        if (square[i].enabled)
+        {
+            const auto duty = nr(0xFF11 + 5*i) >> 6;
+            const bool high = (DUTY_WAVEFORMS[duty] >> square[i].duty_step) & 1;
+            outputs[i] = (high ? square[i].envelope.volume : 0) * 2 - 15;
+        }
+    }
+
+    if (wave.enabled)
+    {
+        const auto byte = nr(0xFF30 + wave.position / 2);
+        const auto level = (nr(0xFF1C) >> 5) & 0x3;
+        int sample = (wave.position & 1) ? byte & 0xF : byte >> 4;
+        sample = level ? sample >> (level - 1) : 0;
+        outputs[2] = sample * 2 - 15;
+    }
+
+    if (noise.enabled)
+    {
+        const bool high = ~noise.lfsr & 1;
+        outputs[3] = (high ? noise.envelope.volume : 0) * 2 - 15;
+    }
+
+    const auto nr50 = nr(0xFF24);
+    const auto nr51 = nr(0xFF25);
+
+    int left = 0;
+    int right = 0;
+    for (int i=0; i<4; ++i)
+    {
+        if (nr51 & (0x10 << i)) left  += outputs[i];
+        if (nr51 & (0x01 << i)) right += outputs[i];
+    }
+
+    //4 channels * 15 * 8 master volume * 64 stays within int16
+    left  *= ((nr50 >> 4) & 0x7) + 1;
+    right *= (nr50 & 0x7) + 1;
+
+    samples.push_back(std::int16_t(left * 64));
+    samples.push_back(std::int16_t(right * 64));
+}
+
+void Apu::serialize(SaveState &state)
+{
+    state(registers)(square)(wave)(noise)(frame_sequencer_ticks)(frame_sequencer_step)(sample_clock);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class SaveState;
+
+class Apu
+{
+public:
+    static constexpr int CPU_CLOCK = 4194304;
+    static constexpr int SAMPLE_RATE = 44100;
+    static constexpr int CHANNELS = 2;
+
+    std::uint8_t read(std::uint16_t address) const;
+    void write(std::uint16_t address, std::uint8_t value);
+
+    void run_once();
+    void serialize(SaveState &state);
+
+    // Interleaved stereo samples mixed since the consumer last drained them.
+    // Nothing is mixed unless sample_output_enabled is set.
+    bool sample_output_enabled = false;
+    std::vector<std::int16_t> samples;
+
+    // 0xFF10 - 0xFF3F : NR10 - NR52 and Wave pattern RAM, as last written
+    std::uint8_t registers[0x30] = {0};
+
+    struct Envelope
+    {
+        std::uint8_t volume = 0;
+        int timer = 0;
+
+        void trigger(std::uint8_t nrx2);
+        void clock(std::uint8_t nrx2);
+    };
+
+    struct Channel
+    {
+        bool enabled = false;
+        int length = 0;
+        int timer = 0;
+
+        void clock_length(std::uint8_t nrx4);
+    };
+
+    struct Square : Channel
+    {
+        Envelope envelope;
+        std::uint8_t duty_step = 0;
+
+        //Channel 1 only
+        bool sweep_enabled = false;
+        int sweep_timer = 0;
+        std::uint16_t shadow_frequency = 0;
+    } square[2];
+
+    struct Wave : Channel
+    {
+        std::uint8_t position = 0;
+    } wave;
+
+    struct Noise : Channel
+    {
+        Envelope envelope;
+        std::uint16_t lfsr = 0x7FFF;
+    } noise;
+
+    int frame_sequencer_ticks = 0;
+    std::uint8_t frame_sequencer_step = 0;
+    int sample_clock = 0;
+
+private:
+    std::uint8_t &nr(std::uint16_t address) { return registers[address - 0xFF10]; }
+    std::uint8_t nr(std::uint16_t address) const { return registers[address - 0xFF10]; }
+
+    void trigger(int channel);
+    void clock_frame_sequencer();
+    int sweep_calculate();
+    void mix_sample();
+};
@@ -0,0 +1,185 @@
+#include "audio_writer.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static const std::uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+static const std::uint64_t FNV_PRIME = 0x100000001b3ull;
+
+static bool ends_with(const std::string &str, const std::string &suffix)
+{
+    return str.size() >= suffix.size()
+        && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+AudioWriter::AudioWriter(const std::string &filename, int sample_rate, int channels)
+    : out(filename, std::ios::binary)
+    , wav(ends_with(filename, ".wav") || ends_with(filename, ".WAV"))
+    , sample_rate(sample_rate)
+    , channels(channels)
+    , block_size(sample_rate * channels / 4)
+{
+    if (!out)
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    if (wav)
+    {
+        write_wav_header();
+    }
+
+    block.reserve(block_size);
+    thread = std::thread(&AudioWriter::writer_loop, this);
+}
+
+AudioWriter::~AudioWriter()
+{
+    close();
+}
+
+void AudioWriter::write(const std::int16_t *samples, std::size_t count)
+{
+    while (count > 0)
+    {
+        auto n = std::min(count, block_size - block.size());
+        block.insert(block.end(), samples, samples + n);
+        samples += n;
+        count -= n;
+
+        if (block.size() == block_size)
+        {
+            submit_block();
+        }
+    }
+}
+
+void AudioWriter::close()
+{
+    if ( ! thread.joinable())
+    {
+        return;
+    }
+
+    if ( ! block.empty())
+    {
+        submit_block();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    wake.notify_one();
+    thread.join();
+
+    if (wav)
+    {
+        out.seekp(0);
+        write_wav_header();
+    }
+    out.close();
+}
+
+void AudioWriter::submit_block()
+{
+    std::vector<std::int16_t> next;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(block));
+        if ( ! spare.empty())
+        {
+            next = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    wake.notify_one();
+
+    block = std::move(next);
+    block.clear();
+    block.reserve(block_size);
+}
+
+void AudioWriter::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [&]{ return closing || ! pending.empty(); });
+
+        if (pending.empty())
+        {
+            return;
+        }
+
+        auto buffer = std::move(pending.front());
+        pending.pop_front();
+
+        lock.unlock();
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(std::int16_t));
+        data_bytes += buffer.size() * sizeof(std::int16_t);
+        lock.lock();
+
+        spare.push_back(std::move(buffer));
+    }
+}
+
+void AudioWriter::write_wav_header()
+{
+    auto put = [&](std::uint32_t value, int bytes)
+    {
+        for (int i=0; i<bytes; ++i)
+        {
+            out.put(char((value >> (8*i)) & 0xFF));
+        }
+    };
+
+    const std::uint32_t block_align = channels * sizeof(std::int16_t);
+
+    out.write("RIFF", 4);
+    put(36 + data_bytes, 4);
+    out.write("WAVE", 4);
+    out.write("fmt ", 4);
+    put(16, 4);                         //fmt chunk size
+    put(1, 2);                          //PCM
+    put(channels, 2);
+    put(sample_rate, 4);
+    put(sample_rate * block_align, 4);  //byte rate
+    put(block_align, 2);
+    put(16, 2);                         //bits per sample
+    out.write("data", 4);
+    put(data_bytes, 4);
+}
+
+AudioHash::AudioHash(int sample_rate, int channels)
+    : samples_per_second(sample_rate * channels)
+    , hash(FNV_OFFSET_BASIS)
+{
+}
+
+void AudioHash::update(const std::int16_t *samples, std::size_t count)
+{
+    for (std::size_t i=0; i<count; ++i)
+    {
+        const auto sample = std::uint16_t(samples[i]);
+        hash = (hash ^ (sample & 0xFF)) * FNV_PRIME;
+        hash = (hash ^ (sample >> 8)) * FNV_PRIME;
+
+        if (++samples_in_second == samples_per_second)
+        {
+            seconds.push_back(hash);
+            samples_in_second = 0;
+            hash = FNV_OFFSET_BASIS;
+        }
+    }
+}
+
+void AudioHash::finish()
+{
+    if (samples_in_second > 0)
+    {
+        seconds.push_back(hash);
+        samples_in_second = 0;
+        hash = FNV_OFFSET_BASIS;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Streams interleaved 16-bit PCM to a .wav file (raw PCM for any other extension).
+// Samples are batched into blocks handed to a background thread, so the
+// emulation loop never waits on disk I/O.
+class AudioWriter
+{
+public:
+    AudioWriter(const std::string &filename, int sample_rate, int channels);
+    ~AudioWriter();
+
+    void write(const std::int16_t *samples, std::size_t count);
+    void close();
+
+private:
+    void submit_block();
+    void writer_loop();
+    void write_wav_header();
+
+    std::ofstream out;
+    bool wav = false;
+    int sample_rate;
+    int channels;
+    std::size_t block_size;
+    std::uint32_t data_bytes = 0;
+
+    std::vector<std::int16_t> block;
+    std::deque<std::vector<std::int16_t>> pending;
+    std::vector<std::vector<std::int16_t>> spare;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool closing = false;
+    std::thread thread;
+};
+
+// FNV-1a of every emulated second of audio, for cheap regression comparisons
+class AudioHash
+{
+public:
+    AudioHash(int sample_rate, int channels);
+
+    void update(const std::int16_t *samples, std::size_t count);
+    void finish();
+
+    std::vector<std::uint64_t> seconds;
+
+private:
+    std::size_t samples_per_second;
+    std::size_t samples_in_second = 0;
+    std::uint64_t hash;
+};
@@ -0,0 +1,114 @@
+#include "battery_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+
+void write_file_atomically(const std::string &filename, const std::uint8_t *data, std::size_t size,
+                           const std::string &temp_file)
+{
+    const auto temp_name = temp_file.empty() ? filename + ".tmp" : temp_file;
+    const int fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Unable to open file: " + temp_name);
+    }
+
+    std::size_t written = 0;
+    while (written < size)
+    {
+        const auto result = ::write(fd, data + written, size - written);
+        if (result < 0)
+        {
+            close(fd);
+            throw std::runtime_error("Unable to write file: " + temp_name);
+        }
+        written += result;
+    }
+
+    //The data has to be on disk before the rename makes it the real file
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    if ( ! synced || std::rename(temp_name.c_str(), filename.c_str()) != 0)
+    {
+        throw std::runtime_error("Unable to replace file: " + filename);
+    }
+}
+
+BatteryWriter &BatteryWriter::instance()
+{
+    static BatteryWriter writer;
+    return writer;
+}
+
+BatteryWriter::~BatteryWriter()
+{
+    if ( ! thread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void BatteryWriter::submit(const std::string &filename, const std::uint8_t *data, std::size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[filename].assign(data, data + size);
+
+        if ( ! thread.joinable())
+        {
+            thread = std::thread(&BatteryWriter::writer_loop, this);
+        }
+    }
+    wake.notify_one();
+}
+
+void BatteryWriter::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [&]{ return pending.empty() && ! writing; });
+}
+
+void BatteryWriter::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        wake.wait(lock, [&]{ return closing || ! pending.empty(); });
+
+        if (pending.empty())
+        {
+            return;
+        }
+
+        auto node = pending.extract(pending.begin());
+        writing = true;
+
+        lock.unlock();
+        try
+        {
+            write_file_atomically(node.key(), node.mapped().data(), node.mapped().size());
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+        lock.lock();
+
+        writing = false;
+        if (pending.empty())
+        {
+            idle.notify_all();
+        }
+    }
+}
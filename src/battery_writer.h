@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Writes battery RAM snapshots on a background thread, shared by every
+// cartridge in the process. Each file is written to a temporary name and
+// renamed over the old one, so a crash leaves either the old or the new
+// contents, never a mix.
+class BatteryWriter
+{
+public:
+    static BatteryWriter &instance();
+
+    ~BatteryWriter();
+
+    /// Queues a copy of data, replacing any snapshot still queued for filename
+    void submit(const std::string &filename, const std::uint8_t *data, std::size_t size);
+    /// Blocks until everything queued so far is on disk
+    void wait();
+
+private:
+    void writer_loop();
+
+    std::map<std::string, std::vector<std::uint8_t>> pending;
+    bool writing = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool closing = false;
+    std::thread thread;
+};
+
+// Temporary file, flush to disk, rename over filename. Writers that may race on the same
+// filename need a temp_name each, the default is filename + ".tmp".
+void write_file_atomically(const std::string &filename, const std::uint8_t *data, std::size_t size,
+                           const std::string &temp_name = "");
@@ -1,33 +1,10 @@
 #include "bus.h"
+#include "save_state.h"
 
 #include <iostream>
 #include <sstream>
 #include <fstream>
 
-std::uint8_t bool_rom_register = 0xFF;
-
-std::uint8_t serial_data = 0;
-std::uint8_t serial_control = 0;
-void serial_transfer_data_write(std::uint8_t data)
-{
-    serial_data = data;
-}
-
-std::uint8_t serial_transfer_data_read()
-{
-    return serial_data;
-}
-
-void serial_transfer_control_write(std::uint8_t data)
-{
-    serial_control = data;
-}
-
-std::uint8_t serial_transfer_control_read()
-{
-    return serial_control;
-}
-
 uint8_t io_read(Bus &bus, std::uint16_t address)
 {
     //$FF00		DMG	Joypad input
@@ -73,17 +50,14 @@ uint8_t io_read(Bus &bus, std::uint16_t address)
 
 
     //$FF01	$FF02	DMG	Serial transfer
-    if (address == 0xFF01) return serial_transfer_data_read();
-    if (address == 0xFF02) return serial_transfer_control_read();
+    if (address == 0xFF01 || address == 0xFF02) { return bus.serial.read(address); }
 
     //$FF04	$FF07	DMG	Timer and divider
     if (0xFF04 <= address && address <= 0xFF07) { return bus.timer.read(address); }
 
     //$FF10	$FF26	DMG	Sound
-    if (0xFF10 <= address && address <= 0xFF26) { return 0xFF; }
-
     //$FF30	$FF3F	DMG	Wave pattern
-    if (0xFF30 <= address && address <= 0xFF3F) { return 0xFF; }
+    if (0xFF10 <= address && address <= 0xFF3F) { return bus.apu.read(address); }
 
     //$FF40	$FF4B	DMG	LCD Control, Status, Position, Scrolling, and Palettes
     if (0xFF40 <= address && address <= 0xFF4B) { return bus.ppu.read(address); }
@@ -92,7 +66,7 @@ uint8_t io_read(Bus &bus, std::uint16_t address)
     if (address == 0xFF4F) return 0xFF; //$FF4F		CGB	VRAM Bank Select
 
     //$FF50		DMG	Set to non-zero to disable boot ROM
-    if (address == 0xFF50) return bool_rom_register;
+    if (address == 0xFF50) return bus.boot_rom_register;
 
     //$FF51	$FF55	CGB	VRAM DMA
     //$FF68	$FF69	CGB	BG / OBJ Palettes
@@ -115,16 +89,14 @@ void io_write(Bus &bus, std::uint16_t address, uint8_t value)
     }
 
     //$FF01	$FF02	DMG	Serial transfer
-    if (address == 0xFF01) { serial_transfer_data_write(value); return; }
-    if (address == 0xFF02) { serial_transfer_control_write(value); return; }
+    if (address == 0xFF01 || address == 0xFF02) { return bus.serial.write(address, value); }
 
     //$FF04	$FF07	DMG	Timer and divider
     if (0xFF04 <= address && address <= 0xFF07) { return bus.timer.write(address, value); }
 
     //$FF10	$FF26	DMG	Sound
-    if (0xFF10 <= address && address <= 0xFF26) { return; }
     //$FF30	$FF3F	DMG	Wave pattern
-    if (0xFF30 <= address && address <= 0xFF3F) { return; }
+    if (0xFF10 <= address && address <= 0xFF3F) { return bus.apu.write(address, value); }
 
     //$FF40	$FF4B	DMG	LCD Control, Status, Position, Scrolling, and Palettes
     if (0xFF40 <= address && address <= 0xFF4B) { return bus.ppu.write(address, value); }
@@ -133,7 +105,7 @@ void io_write(Bus &bus, std::uint16_t address, uint8_t value)
     if (address == 0xFF4F) { return; }
 
     //$FF50		DMG	Set to non-zero to disable boot ROM
-    if (address == 0xFF50) { bool_rom_register = value; return ; }
+    if (address == 0xFF50) { bus.boot_rom_register = value; return ; }
 
     //$FF51	$FF55	CGB	VRAM DMA
     //$FF68	$FF69	CGB	BG / OBJ Palettes
@@ -152,18 +124,8 @@ void io_write(Bus &bus, std::uint16_t address, uint8_t value)
     throw std::runtime_error(out.str());
 }
 
-uint8_t Bus::read(std::uint16_t address)
+uint8_t Bus::read_mapped(std::uint16_t address)
 {
-    //0000	3FFF	16 KiB ROM bank 00	From cartridge, usually a fixed bank
-    if (0x0000 <= address && address  <= 0x3FFF)
-    {
-        return cart.read(address);
-    }
-    //4000	7FFF	16 KiB ROM Bank 01~NN	From cartridge, switchable bank via mapper (if any)
-    if (0x4000 <= address && address <= 0x7FFF)
-    {
-        return cart.read(address);
-    }
     //8000	9FFF	8 KiB Video RAM (VRAM)	In CGB mode, switchable bank 0/1
     if (0x8000 <= address && address <= 0x9FFF)
     {
@@ -235,7 +197,7 @@ void Bus::write(uint16_t address, uint8_t value)
     //8000	9FFF	8 KiB Video RAM (VRAM)	In CGB mode, switchable bank 0/1
     if (0x8000 <= address && address <= 0x9FFF)
     {
-        ppu.video_ram[address - 0x8000] = value;
+        ppu.write_vram(address - 0x8000, value);
         return;
     }
     //A000	BFFF	8 KiB External RAM	From cartridge, switchable bank if any
@@ -297,3 +259,8 @@ void Bus::write(uint16_t address, uint8_t value)
     throw std::runtime_error(out.str());
 }
 
+
+void Bus::serialize(SaveState &state)
+{
+    state(work_ram1)(work_ram2)(high_ram)(p1_joypad)(boot_rom_register);
+}
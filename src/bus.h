@@ -3,13 +3,27 @@
 #include "cartridge.h"
 #include "interrupts.h"
 #include "timer.h"
+#include "serial.h"
 #include "ppu.h"
+#include "apu.h"
 
 struct Bus
 {
-    std::uint8_t read(std::uint16_t address);
+    // ROM reads, every instruction fetch among them, stay inline
+    std::uint8_t read(std::uint16_t address)
+    {
+        //0000	7FFF	32 KiB ROM, bank 00 and a bank switchable via mapper (if any)
+        if (address <= 0x7FFF)
+        {
+            return cart.read(address);
+        }
+        return read_mapped(address);
+    }
+    std::uint8_t read_mapped(std::uint16_t address);
     void write(std::uint16_t address, std::uint8_t value);
 
+    void serialize(SaveState &state);
+
     std::uint16_t read16(std::uint16_t address)
     {
         std::uint8_t lsb = read(address + 0);
@@ -24,7 +38,9 @@ struct Bus
 
     Interrupts &interrupts;
     Timer &timer;
+    Serial &serial;
     Ppu &ppu;
+    Apu &apu;
 
     // 0x0000 - 0x3FFF : ROM Bank 0
     // 0x4000 - 0x7FFF : ROM Bank 1 - Switchable
@@ -36,6 +52,9 @@ struct Bus
     // 0xD000 - 0xDFFF : RAM Bank 1-7 - switchable - Color only
     std::uint8_t work_ram2[0x1000] = {0};
 
+    // 0xFF50 : Boot ROM disable
+    std::uint8_t boot_rom_register = 0xFF;
+
     // 0xFF80 - 0xFFFE : High RAM (HRAM)
     std::uint8_t high_ram[0x80] = {0};
 
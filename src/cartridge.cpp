@@ -1,7 +1,17 @@
 #include "cartridge.h"
+#include "save_state.h"
+#include "battery_writer.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <array>
+#include <chrono>
+#include <cstring>
+
+void MemoryBankController::serialize(SaveState &state)
+{
+    state(battery_dirty);
+}
 
 struct MBC0 : MemoryBankController
 {
@@ -27,7 +37,13 @@ struct MBC1 : MemoryBankController
     uint8_t selected_rom_bank = 1;
     uint8_t selected_ram_bank = 0;
 
-    uint8_t read(uint16_t address) override
+    void serialize(SaveState &state) override
+    {
+        MemoryBankController::serialize(state);
+        state(ram_enabled)(rom_banking_mode)(selected_rom_bank)(selected_ram_bank);
+    }
+
+    std::size_t rom_offset(uint16_t address) override
     {
         if (0x0000 <= address && address <= 0x3FFF)
         {
@@ -35,18 +51,20 @@ struct MBC1 : MemoryBankController
             {
                 auto rom_bank_0 = selected_rom_bank & 0b11100000;
                 auto bank_address = address + rom_bank_0 * 0x4000;
-                return rom[bank_address & (rom_size - 1)];
-            }
-            else
-            {
-                return rom[address];
+                return bank_address & (rom_size - 1);
             }
+            return address;
         }
 
-        if (0x4000 <= address && address <= 0x7FFF)
+        auto bank_address = (address - 0x4000) + selected_rom_bank * 0x4000;
+        return bank_address & (rom_size - 1);
+    }
+
+    uint8_t read(uint16_t address) override
+    {
+        if (0x0000 <= address && address <= 0x7FFF)
         {
-            auto bank_address = (address - 0x4000) + selected_rom_bank * 0x4000;
-            return rom[bank_address & (rom_size - 1)];
+            return rom[rom_offset(address)];
         }
 
         if (0xA000 <= address && address <= 0xBFFF)
@@ -124,6 +142,7 @@ struct MBC1 : MemoryBankController
 
                 ram[ram_address] = value;
                 battery_dirty = true;
+                ++battery_writes;
             }
             return;
         }
@@ -134,18 +153,186 @@ struct MBC1 : MemoryBankController
     }
 };
 
+static std::uint64_t host_seconds()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
 struct MBC3 : MBC1
 {
-    uint8_t read(uint16_t address) override
+    // The RTC oscillator runs at 32768 Hz, but only whole seconds are visible
+    static const std::uint64_t RTC_TICKS_PER_SECOND = 4194304;
+    static const std::uint64_t RTC_TICKS_PER_DAY = RTC_TICKS_PER_SECOND * 60 * 60 * 24;
+
+    bool has_rtc = false;
+    // Host wall clock instead of the emulated cycle counter
+    bool rtc_real_time = false;
+
+    // The clock is never ticked: it counted rtc_elapsed ticks up to rtc_base,
+    // and rtc_sync() adds whatever the clock source advanced since
+    std::uint64_t rtc_elapsed = 0;
+    std::uint64_t rtc_base = 0;
+    bool rtc_halted = false;
+    bool rtc_day_carry = false;
+    uint8_t rtc_latched[5] = { 0 };
+    uint8_t rtc_latch_write = 0xFF;
+    // Host time the battery file was written, caught up on once real time is enabled
+    std::uint64_t rtc_saved_time = 0;
+
+    explicit MBC3(bool has_rtc) : has_rtc(has_rtc) {}
+
+    void serialize(SaveState &state) override
+    {
+        MBC1::serialize(state);
+        state(rtc_elapsed)(rtc_base)(rtc_halted)(rtc_day_carry)(rtc_latched)(rtc_latch_write);
+    }
+
+    void serialize_powered(SaveState &state) override
+    {
+        if ( ! state.is_loading())
+        {
+            rtc_sync();
+        }
+        state(rtc_elapsed)(rtc_halted)(rtc_day_carry)(rtc_latched);
+        //Counts on from now on whatever clock it follows, which a reset may have rewound
+        rtc_base = rtc_now();
+    }
+
+    std::uint64_t rtc_now() const
+    {
+        if (rtc_real_time)
+        {
+            const auto now = std::chrono::system_clock::now().time_since_epoch();
+            const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(now);
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(now - seconds);
+            return seconds.count() * RTC_TICKS_PER_SECOND + nanoseconds.count() * RTC_TICKS_PER_SECOND / 1000000000;
+        }
+        return clock ? *clock : 0;
+    }
+
+    void rtc_sync()
+    {
+        const auto now = rtc_now();
+        if ( ! rtc_halted && now > rtc_base)
+        {
+            rtc_elapsed += now - rtc_base;
+        }
+        rtc_base = now;
+
+        //The day counter has 9 bits, overflowing sets a carry that stays until written
+        const auto days = rtc_elapsed / RTC_TICKS_PER_DAY;
+        if (days >= 512)
+        {
+            rtc_day_carry = true;
+            rtc_elapsed -= days / 512 * 512 * RTC_TICKS_PER_DAY;
+        }
+    }
+
+    void rtc_registers(uint8_t registers[5]) const
+    {
+        const auto seconds = rtc_elapsed / RTC_TICKS_PER_SECOND;
+        const auto days = seconds / (60 * 60 * 24);
+        registers[0] = seconds % 60;
+        registers[1] = seconds / 60 % 60;
+        registers[2] = seconds / (60 * 60) % 24;
+        registers[3] = days & 0xFF;
+        registers[4] = (days >> 8 & 0x01) | rtc_halted << 6 | rtc_day_carry << 7;
+    }
+
+    // Out of range values (61 seconds, 25 hours) are carried into the next field right away
+    void rtc_set_registers(const uint8_t registers[5], std::uint64_t subsecond)
+    {
+        const std::uint64_t days = registers[3] | (registers[4] & 0x01) << 8;
+        const auto seconds = ((days * 24 + (registers[2] & 0x1F)) * 60 + (registers[1] & 0x3F)) * 60 + (registers[0] & 0x3F);
+        rtc_elapsed = seconds * RTC_TICKS_PER_SECOND + subsecond;
+        rtc_halted = registers[4] & 0x40;
+        rtc_day_carry = registers[4] & 0x80;
+    }
+
+    void set_real_time(bool real_time) override
+    {
+        if ( ! has_rtc)
+        {
+            return;
+        }
+
+        rtc_sync();
+        rtc_real_time = real_time;
+        rtc_base = rtc_now();
+
+        //The cartridge kept counting while the emulator wasn't running
+        const auto now = host_seconds();
+        if (real_time && ! rtc_halted && rtc_saved_time && now > rtc_saved_time)
+        {
+            rtc_elapsed += (now - rtc_saved_time) * RTC_TICKS_PER_SECOND;
+        }
+        rtc_saved_time = 0;
+    }
+
+    // Same layout as VBA and BGB: current and latched registers as 32-bit values, then a 64-bit UNIX time
+    std::vector<uint8_t> battery_footer() override
+    {
+        if ( ! has_rtc)
+        {
+            return {};
+        }
+
+        rtc_sync();
+        uint8_t registers[5];
+        rtc_registers(registers);
+
+        std::vector<uint8_t> footer(48, 0);
+        for (int i=0; i<5; ++i)
+        {
+            footer[4*i] = registers[i];
+            footer[20 + 4*i] = rtc_latched[i];
+        }
+        const auto now = host_seconds();
+        for (int i=0; i<8; ++i)
+        {
+            footer[40 + i] = now >> (8*i);
+        }
+        return footer;
+    }
+
+    void load_battery_footer(const uint8_t *footer, std::size_t size) override
+    {
+        //Some emulators write a 32-bit time
+        if ( ! has_rtc || size < 44)
+        {
+            return;
+        }
+
+        uint8_t registers[5];
+        for (int i=0; i<5; ++i)
+        {
+            registers[i] = footer[4*i];
+            rtc_latched[i] = footer[20 + 4*i];
+        }
+        rtc_set_registers(registers, 0);
+        rtc_base = rtc_now();
+
+        rtc_saved_time = 0;
+        for (std::size_t i=0; i<8 && 40 + i < size; ++i)
+        {
+            rtc_saved_time |= std::uint64_t(footer[40 + i]) << (8*i);
+        }
+    }
+
+    std::size_t rom_offset(uint16_t address) override
     {
         if (0x0000 <= address && address <= 0x3FFF)
         {
-            return rom[address];
+            return address;
         }
+        return (selected_rom_bank * 0x4000 + address - 0x4000) & (rom_size - 1);
+    }
 
-        if (0x4000 <= address && address <= 0x7FFF)
+    uint8_t read(uint16_t address) override
+    {
+        if (0x0000 <= address && address <= 0x7FFF)
         {
-            return rom[selected_rom_bank * 0x4000 + address - 0x4000];
+            return rom[rom_offset(address)];
         }
 
         if(0xA000 <= address && address <= 0xBFFF)
@@ -154,6 +341,10 @@ struct MBC3 : MBC1
             {
                 return ram[selected_ram_bank * 0x2000 + address - 0xA000];
             }
+            if (ram_enabled && has_rtc && 0x08 <= selected_ram_bank && selected_ram_bank <= 0x0C)
+            {
+                return rtc_latched[selected_ram_bank - 0x08];
+            }
         }
 
         return 0;
@@ -186,12 +377,40 @@ struct MBC3 : MBC1
             return;
         }
 
+        //6000-7FFF - Latch Clock Data (Write Only): 00 then 01 copies the clock into the registers
+        if (0x6000 <= address && address <= 0x7FFF)
+        {
+            if (has_rtc && rtc_latch_write == 0x00 && value == 0x01)
+            {
+                rtc_sync();
+                rtc_registers(rtc_latched);
+            }
+            rtc_latch_write = value;
+            return;
+        }
+
         if (0xA000 <= address && address <= 0xBFFF)
         {
             if (ram_enabled && selected_ram_bank <= 3)
             {
                 ram[selected_ram_bank * 0x2000 + address - 0xA000] = value;
                 battery_dirty = true;
+                ++battery_writes;
+                return;
+            }
+            if (ram_enabled && has_rtc && 0x08 <= selected_ram_bank && selected_ram_bank <= 0x0C)
+            {
+                rtc_sync();
+                uint8_t registers[5];
+                rtc_registers(registers);
+                registers[selected_ram_bank - 0x08] = value;
+
+                //Writing the seconds resets the divider that counts towards the next second
+                const auto subsecond = selected_ram_bank == 0x08 ? 0 : rtc_elapsed % RTC_TICKS_PER_SECOND;
+                rtc_set_registers(registers, subsecond);
+                rtc_latched[selected_ram_bank - 0x08] = value;
+                battery_dirty = true;
+                ++battery_writes;
                 return;
             }
         }
@@ -200,16 +419,20 @@ struct MBC3 : MBC1
 
 struct MBC5 : MBC1
 {
-    uint8_t read(uint16_t address) override
+    std::size_t rom_offset(uint16_t address) override
     {
         if (0x0000 <= address && address <= 0x3FFF)
         {
-            return rom[address];
+            return address;
         }
+        return (selected_rom_bank * 0x4000 + address - 0x4000) & (rom_size - 1);
+    }
 
-        if (0x4000 <= address && address <= 0x7FFF)
+    uint8_t read(uint16_t address) override
+    {
+        if (0x0000 <= address && address <= 0x7FFF)
         {
-            return rom[selected_rom_bank * 0x4000 + address - 0x4000];
+            return rom[rom_offset(address)];
         }
 
         if(0xA000 <= address && address <= 0xBFFF)
@@ -259,17 +482,46 @@ struct MBC5 : MBC1
             {
                 ram[selected_ram_bank * 0x2000 + address - 0xA000] = value;
                 battery_dirty = true;
+                ++battery_writes;
                 return;
             }
         }
     }
 };
 
+template<typename MBC>
+static std::uint8_t read_controller(MemoryBankController &mbc, std::uint16_t address)
+{
+    return static_cast<MBC &>(mbc).MBC::read(address);
+}
+
+// Bank selection of the concrete type inlines here, writes to 0x0000-0x7FFF are the only way banks change
+template<typename MBC>
+static void write_controller(Cartridge &cart, std::uint16_t address, std::uint8_t value)
+{
+    auto &mbc = static_cast<MBC &>(*cart.mbc);
+    mbc.MBC::write(address, value);
+
+    if (address <= 0x7FFF)
+    {
+        cart.rom_banks[0] = mbc.rom + mbc.MBC::rom_offset(0x0000);
+        cart.rom_banks[1] = mbc.rom + mbc.MBC::rom_offset(0x4000);
+    }
+}
+
+template<typename MBC, typename... Args>
+static std::unique_ptr<MemoryBankController> make_controller(Cartridge &cart, Args... args)
+{
+    cart.read_function = &read_controller<MBC>;
+    cart.write_function = &write_controller<MBC>;
+    return std::make_unique<MBC>(args...);
+}
+
 const char *cartridge_type(const CartridgeHeader *header)
 {
-    static const char *types[0xFF+1] = { 0 };
-    if (types[0x00] == nullptr)
+    static const auto types = []
     {
+        std::array<const char *, 0xFF+1> types = { 0 };
         types[0x00] = "ROM ONLY";
         types[0x01] = "MBC1";
         types[0x02] = "MBC1+RAM";
@@ -298,7 +550,8 @@ const char *cartridge_type(const CartridgeHeader *header)
         types[0xFD] = "BANDAI TAMA5";
         types[0xFE] = "HuC3";
         types[0xFF] = "HuC1+RAM+BATTERY";
-    }
+        return types;
+    }();
     return types[header->cartridge_type];
 }
 
@@ -323,33 +576,22 @@ bool has_battery(const CartridgeHeader *header)
     return false;
 }
 
-void Cartridge::load(const std::string &filename)
+void Cartridge::load(const std::string &filename, const std::string &patch_file)
 {
-    {
-        std::ifstream fp(filename, std::ios::binary);
+    rom_image = RomImage::open(filename, patch_file);
+    const auto &rom = *rom_image;
 
-        if (!fp)
-        {
-            throw std::runtime_error("Unable to open file: " + filename);
-        }
-
-        fp.seekg(0, std::ios::end);
-        std::uint64_t rom_size = fp.tellg();
-
-        fp.seekg(0, std::ios::beg);
-        rom_data.resize(rom_size);
-
-        fp.read((char*)rom_data.data(), rom_data.size());
+    if (rom.size() < 0x150)
+    {
+        throw std::runtime_error("ROM is too small to have a header: " + filename);
     }
 
-    header = new (&rom_data[0x100]) CartridgeHeader;
-
-    header->title[15] = 0;
+    header = reinterpret_cast<const CartridgeHeader *>(&rom[0x100]);
 
     std::uint16_t x = 0;
     for (std::uint16_t i=0x0134; i<=0x014C; i++)
     {
-        x = x - rom_data[i] - 1;
+        x = x - rom[i] - 1;
     }
 
     if ( ! (x & 0xFF) )
@@ -367,55 +609,125 @@ void Cartridge::load(const std::string &filename)
 
     mbc = [&]() -> std::unique_ptr<MemoryBankController> {
         switch (header->cartridge_type) {
-            case 0x00: return std::make_unique<MBC0>();
+            case 0x00: return make_controller<MBC0>(*this);
 
-            case 0x01: return std::make_unique<MBC1>();
-            case 0x02: return std::make_unique<MBC1>();
-            case 0x03: return std::make_unique<MBC1>(); //BATTERY
+            case 0x01: return make_controller<MBC1>(*this);
+            case 0x02: return make_controller<MBC1>(*this);
+            case 0x03: return make_controller<MBC1>(*this); //BATTERY
 
-            case 0x0F: return std::make_unique<MBC3>();
-            case 0x10: return std::make_unique<MBC3>();
-            case 0x11: return std::make_unique<MBC3>();
-            case 0x12: return std::make_unique<MBC3>();
-            case 0x13: return std::make_unique<MBC3>(); //BATTERY 2
+            case 0x0F: return make_controller<MBC3>(*this, true); //TIMER
+            case 0x10: return make_controller<MBC3>(*this, true); //TIMER
+            case 0x11: return make_controller<MBC3>(*this, false);
+            case 0x12: return make_controller<MBC3>(*this, false);
+            case 0x13: return make_controller<MBC3>(*this, false); //BATTERY 2
 
-            case 0x19: return std::make_unique<MBC5>();
-            case 0x1A: return std::make_unique<MBC5>();
-            case 0x1B: return std::make_unique<MBC5>(); //BATTERY
-            case 0x1C: return std::make_unique<MBC5>();
-            case 0x1D: return std::make_unique<MBC5>();
-            case 0x1E: return std::make_unique<MBC5>(); //BATTERY
+            case 0x19: return make_controller<MBC5>(*this);
+            case 0x1A: return make_controller<MBC5>(*this);
+            case 0x1B: return make_controller<MBC5>(*this); //BATTERY
+            case 0x1C: return make_controller<MBC5>(*this);
+            case 0x1D: return make_controller<MBC5>(*this);
+            case 0x1E: return make_controller<MBC5>(*this); //BATTERY
 
             default: throw std::runtime_error("Cartridge type not supported: "+std::to_string(header->cartridge_type)+" "+cartridge_type(header));
         }
     }();
 
-    mbc->rom = rom_data.data();
-    mbc->rom_size = rom_data.size();
+    mbc->rom = rom.data();
+    mbc->rom_size = rom.size();
     mbc->ram = ram_banks.data();
     mbc->ram_size = ram_banks.size();
+    update_rom_banks();
+}
+
+std::string Cartridge::title() const
+{
+    return std::string(header->title, strnlen(header->title, 15));
 }
 
 void Cartridge::save_battery()
 {
-    if ( ! has_battery(header) )
+    if ( ! has_battery(header) || ! battery_file )
     {
         return;
     }
 
-    std::ofstream out(std::string(header->title)+".battery", std::ios::binary);
-    out.write(reinterpret_cast<const char*>(ram_banks.data()), ram_banks.size());
+    //An older snapshot still queued must not land after this one
+    BatteryWriter::instance().wait();
+    const auto image = battery_image();
+    //Runs from the destructor, a save that can't be written is reported and left dirty
+    try
+    {
+        write_file_atomically(title()+".battery", image.data(), image.size());
+        mbc->battery_dirty = false;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+// Cartridge RAM followed by whatever else the controller keeps powered, like the RTC
+std::vector<std::uint8_t> Cartridge::battery_image()
+{
+    auto image = ram_banks;
+    const auto footer = mbc->battery_footer();
+    image.insert(image.end(), footer.begin(), footer.end());
+    return image;
+}
+
+void Cartridge::poll_battery()
+{
+    if ( ! mbc->battery_dirty || ! has_battery(header) || ! battery_file )
+    {
+        return;
+    }
+
+    if (mbc->battery_writes != battery_writes_seen)
+    {
+        battery_writes_seen = mbc->battery_writes;
+        battery_quiet_polls = 0;
+    }
+
+    //Wait for the game to finish saving, unless it keeps writing for too long
+    ++battery_quiet_polls;
+    ++battery_unsaved_polls;
+    if (battery_quiet_polls < BATTERY_QUIET_POLLS && battery_unsaved_polls < BATTERY_MAX_UNSAVED_POLLS)
+    {
+        return;
+    }
+
+    const auto image = battery_image();
+    BatteryWriter::instance().submit(title()+".battery", image.data(), image.size());
     mbc->battery_dirty = false;
+    battery_quiet_polls = 0;
+    battery_unsaved_polls = 0;
 }
 
 void Cartridge::load_battery()
 {
-    if ( ! has_battery(header) )
+    if ( ! has_battery(header) || ! battery_file )
     {
         return;
     }
 
-    std::ifstream in(std::string(header->title)+".battery", std::ios::binary);
+    BatteryWriter::instance().wait();
+    std::ifstream in(title()+".battery", std::ios::binary);
     in.read(reinterpret_cast<char*>(ram_banks.data()), ram_banks.size());
+
+    const std::vector<std::uint8_t> footer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    mbc->load_battery_footer(footer.data(), footer.size());
 }
 
+
+void Cartridge::serialize(SaveState &state)
+{
+    mbc->serialize(state);
+    state.bytes(ram_banks.data(), ram_banks.size());
+    update_rom_banks();
+}
+
+void Cartridge::update_rom_banks()
+{
+    rom_banks[0] = mbc->rom + mbc->rom_offset(0x0000);
+    rom_banks[1] = mbc->rom + mbc->rom_offset(0x4000);
+}
@@ -4,6 +4,10 @@
 #include <string>
 #include <memory>
 
+#include "rom_image.h"
+
+class SaveState;
+
 struct CartridgeHeader {
     std::uint8_t entry_point[4];      //0100-0103
     std::uint8_t nintendo_logo[0x30]; //0104-0133
@@ -28,29 +32,66 @@ bool has_battery(const CartridgeHeader *header);
 
 struct MemoryBankController
 {
-    uint8_t *rom = nullptr;
+    const uint8_t *rom = nullptr;
     std::size_t rom_size=0;
 
     uint8_t *ram = nullptr;
     std::size_t ram_size=0;
 
     bool battery_dirty = false;
+    // Bumped on every battery RAM write, not part of the saved state
+    std::uint32_t battery_writes = 0;
 
     virtual uint8_t read(uint16_t address) = 0;
     virtual void write(uint16_t address, uint8_t value) = 0;
+
+    // Ticks since power on of the owning System, drives the MBC3 RTC
+    const std::uint64_t *clock = nullptr;
+
+    // Offset into rom that a read from 0x0000-0x7FFF currently maps to
+    virtual std::size_t rom_offset(uint16_t address) { return address; }
+
+    // Follow the host clock instead of emulated time, for timers that keep running while switched off
+    virtual void set_real_time(bool) {}
+    // Saved after the cartridge RAM in the battery file
+    virtual std::vector<uint8_t> battery_footer() { return {}; }
+    virtual void load_battery_footer(const uint8_t *, std::size_t) {}
+    // Whatever besides RAM the battery keeps going, carried across System::reset()
+    virtual void serialize_powered(SaveState &) {}
+
+    virtual void serialize(SaveState &state);
     virtual ~MemoryBankController() = default;
 };
 
 struct Cartridge
 {
     std::unique_ptr<MemoryBankController> mbc;
-    std::vector<std::uint8_t> rom_data;
+    std::shared_ptr<const RomImage> rom_image;
     std::vector<std::uint8_t> ram_banks;
-    CartridgeHeader *header;
+    const CartridgeHeader *header;
+
+    // Counts writes to the MBC registers, so translated code notices a bank switch
+    std::uint32_t bank_switches = 0;
+
+    // ROM currently visible at 0x0000-0x3FFF and 0x4000-0x7FFF, so instruction fetch needs no MBC call
+    const std::uint8_t *rom_banks[2] = { nullptr, nullptr };
+
+    // Instantiated for the concrete controller type and picked once in load(), skipping virtual dispatch
+    std::uint8_t (*read_function)(MemoryBankController &mbc, std::uint16_t address) = nullptr;
+    void (*write_function)(Cartridge &cart, std::uint16_t address, std::uint8_t value) = nullptr;
+
+    static const int BATTERY_QUIET_POLLS = 30;
+    static const int BATTERY_MAX_UNSAVED_POLLS = 600;
+    std::uint32_t battery_writes_seen = 0;
+    int battery_quiet_polls = 0;
+    int battery_unsaved_polls = 0;
+    // Off to leave <title>.battery alone, battery RAM then starts empty and is never saved
+    bool battery_file = true;
 
-    Cartridge(const std::string &filename)
+    Cartridge(const std::string &filename, const std::string &patch_file = "", bool battery_file = true)
+        : battery_file(battery_file)
     {
-        load(filename);
+        load(filename, patch_file);
         load_battery();
     }
     ~Cartridge()
@@ -61,18 +102,42 @@ struct Cartridge
         }
     }
 
-    void load(const std::string &filename);
+    // patch_file is an IPS or BPS patch applied on top of the ROM, empty for none
+    void load(const std::string &filename, const std::string &patch_file = "");
+
+    // Up to 15 characters, the last title byte is the CGB flag on newer carts
+    std::string title() const;
 
     void save_battery();
     void load_battery();
+    std::vector<std::uint8_t> battery_image();
+
+    /// Call once per frame: hands dirty battery RAM to the background writer once the game stops writing
+    void poll_battery();
+
+    void serialize(SaveState &state);
+    void update_rom_banks();
 
     std::uint8_t read(std::uint16_t address)
     {
-        return mbc->read(address);
+        if (address <= 0x7FFF)
+        {
+            return rom_banks[address >> 14][address & 0x3FFF];
+        }
+        return read_function(*mbc, address);
+    }
+
+    std::size_t rom_offset(std::uint16_t address)
+    {
+        return mbc->rom_offset(address);
     }
 
     void write(std::uint16_t address, std::uint8_t value)
     {
-        return mbc->write(address, value);
+        if (address <= 0x7FFF)
+        {
+            ++bank_switches;
+        }
+        return write_function(*this, address, value);
     }
 };
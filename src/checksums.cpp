@@ -0,0 +1,268 @@
+#include "checksums.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Slicing-by-8: eight tables let the loop consume a 64-bit word per step
+std::uint32_t crc32(const std::uint8_t *data, std::size_t size, std::uint32_t crc)
+{
+    static const auto tables = []
+    {
+        std::array<std::array<std::uint32_t, 256>, 8> tables;
+        for (std::uint32_t i=0; i<256; ++i)
+        {
+            std::uint32_t value = i;
+            for (int bit=0; bit<8; ++bit)
+            {
+                value = (value & 1) ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+            }
+            tables[0][i] = value;
+        }
+        for (std::uint32_t i=0; i<256; ++i)
+        {
+            for (int slice=1; slice<8; ++slice)
+            {
+                const auto previous = tables[slice - 1][i];
+                tables[slice][i] = tables[0][previous & 0xFF] ^ (previous >> 8);
+            }
+        }
+        return tables;
+    }();
+
+    crc = ~crc;
+    for (; size >= 8; data += 8, size -= 8)
+    {
+        std::uint32_t low, high;
+        std::memcpy(&low, data, 4);
+        std::memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = tables[7][low & 0xFF] ^ tables[6][(low >> 8) & 0xFF] ^ tables[5][(low >> 16) & 0xFF] ^ tables[4][low >> 24]
+            ^ tables[3][high & 0xFF] ^ tables[2][(high >> 8) & 0xFF] ^ tables[1][(high >> 16) & 0xFF] ^ tables[0][high >> 24];
+    }
+    for (; size > 0; ++data, --size)
+    {
+        crc = tables[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static std::uint32_t rotate_left(std::uint32_t value, int bits)
+{
+    return value << bits | value >> (32 - bits);
+}
+
+//FIPS 180-4
+static void sha1_blocks_portable(std::uint32_t state[5], const std::uint8_t *block, std::size_t count)
+{
+    for (; count > 0; --count, block += 64)
+    {
+        std::uint32_t w[80];
+        for (int i=0; i<16; ++i)
+        {
+            w[i] = block[4*i] << 24 | block[4*i + 1] << 16 | block[4*i + 2] << 8 | block[4*i + 3];
+        }
+        for (int i=16; i<80; ++i)
+        {
+            w[i] = rotate_left(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+        }
+
+        std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i=0; i<80; ++i)
+        {
+            std::uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+            const std::uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate_left(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// SHA extensions: four rounds per instruction, message schedule in hardware
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_sha_ni(std::uint32_t state[5], const std::uint8_t *block, std::size_t count)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ull, 0x08090a0b0c0d0e0full);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1;
+
+    for (; count > 0; --count, block += 64)
+    {
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+
+        const auto *words = reinterpret_cast<const __m128i *>(block);
+
+        //Rounds 0-15 load the message
+        __m128i msg0 = _mm_shuffle_epi8(_mm_loadu_si128(words + 0), byte_swap);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        __m128i msg1 = _mm_shuffle_epi8(_mm_loadu_si128(words + 1), byte_swap);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        __m128i msg2 = _mm_shuffle_epi8(_mm_loadu_si128(words + 2), byte_swap);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        __m128i msg3 = _mm_shuffle_epi8(_mm_loadu_si128(words + 3), byte_swap);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        //Rounds 16-63, each group of four extends the schedule by four words
+#define SHA1_ROUNDS(E_IN, E_OUT, FUNC, W, NEXT, XOR, MSG1) \
+        E_IN = _mm_sha1nexte_epu32(E_IN, W); \
+        E_OUT = abcd; \
+        NEXT = _mm_sha1msg2_epu32(NEXT, W); \
+        abcd = _mm_sha1rnds4_epu32(abcd, E_IN, FUNC); \
+        MSG1 = _mm_sha1msg1_epu32(MSG1, W); \
+        XOR = _mm_xor_si128(XOR, W);
+
+        SHA1_ROUNDS(e0, e1, 0, msg0, msg1, msg2, msg3)
+        SHA1_ROUNDS(e1, e0, 1, msg1, msg2, msg3, msg0)
+        SHA1_ROUNDS(e0, e1, 1, msg2, msg3, msg0, msg1)
+        SHA1_ROUNDS(e1, e0, 1, msg3, msg0, msg1, msg2)
+        SHA1_ROUNDS(e0, e1, 1, msg0, msg1, msg2, msg3)
+        SHA1_ROUNDS(e1, e0, 1, msg1, msg2, msg3, msg0)
+        SHA1_ROUNDS(e0, e1, 2, msg2, msg3, msg0, msg1)
+        SHA1_ROUNDS(e1, e0, 2, msg3, msg0, msg1, msg2)
+        SHA1_ROUNDS(e0, e1, 2, msg0, msg1, msg2, msg3)
+        SHA1_ROUNDS(e1, e0, 2, msg1, msg2, msg3, msg0)
+        SHA1_ROUNDS(e0, e1, 2, msg2, msg3, msg0, msg1)
+        SHA1_ROUNDS(e1, e0, 3, msg3, msg0, msg1, msg2)
+#undef SHA1_ROUNDS
+
+        //Rounds 64-79 finish the schedule up to the last four words
+        e0 = _mm_sha1nexte_epu32(e0, msg0);
+        e1 = abcd;
+        msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+        msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+        msg2 = _mm_xor_si128(msg2, msg0);
+
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static bool has_sha_ni()
+{
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+
+static void sha1_blocks(std::uint32_t state[5], const std::uint8_t *block, std::size_t count)
+{
+    static const bool sha_ni = has_sha_ni();
+    if (sha_ni)
+    {
+        sha1_blocks_sha_ni(state, block, count);
+    }
+    else
+    {
+        sha1_blocks_portable(state, block, count);
+    }
+}
+
+#else
+
+static void sha1_blocks(std::uint32_t state[5], const std::uint8_t *block, std::size_t count)
+{
+    sha1_blocks_portable(state, block, count);
+}
+
+#endif
+
+Sha1 sha1(const std::uint8_t *data, std::size_t size)
+{
+    std::uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+    const std::size_t offset = size & ~std::size_t(63);
+    sha1_blocks(state, data, size / 64);
+
+    //Padding: 0x80, zeros, then the message length in bits
+    std::uint8_t tail[128] = { 0 };
+    const std::size_t remaining = size - offset;
+    std::memcpy(tail, data + offset, remaining);
+    tail[remaining] = 0x80;
+
+    const std::size_t tail_size = remaining < 56 ? 64 : 128;
+    const std::uint64_t bits = std::uint64_t(size) * 8;
+    for (int i=0; i<8; ++i)
+    {
+        tail[tail_size - 1 - i] = bits >> (8*i);
+    }
+
+    sha1_blocks(state, tail, tail_size / 64);
+
+    Sha1 digest;
+    for (int i=0; i<20; ++i)
+    {
+        digest[i] = state[i / 4] >> (24 - 8*(i % 4));
+    }
+    return digest;
+}
+
+std::string to_hex(const std::uint8_t *data, std::size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    std::string hex;
+    hex.reserve(size * 2);
+    for (std::size_t i=0; i<size; ++i)
+    {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0xF];
+    }
+    return hex;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// CRC-32 as used by zip and No-Intro ROM sets
+std::uint32_t crc32(const std::uint8_t *data, std::size_t size, std::uint32_t crc = 0);
+
+using Sha1 = std::array<std::uint8_t, 20>;
+Sha1 sha1(const std::uint8_t *data, std::size_t size);
+
+std::string to_hex(const std::uint8_t *data, std::size_t size);
@@ -1,6 +1,7 @@
 #include "cpu.h"
 
 #include "instructions.h"
+#include "save_state.h"
 
 #include <iomanip>
 #include <iostream>
@@ -127,6 +128,7 @@ std::size_t fetch_data_and_call(Cpu &cpu)
         return run_extendend_instruction_helper<>(ext_opcode, cpu);
     }
 
+    if (cpu.trace_instructions)
     {
         std::ostringstream out;
         print_inst<Inst>(out, cpu);
@@ -213,3 +215,8 @@ size_t Cpu::run_interrupts()
 
     return 0;
 }
+
+void Cpu::serialize(SaveState &state)
+{
+    state(registers)(halted)(inerrupts_master_enable_flag)(arg1)(arg2);
+}
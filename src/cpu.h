@@ -56,7 +56,10 @@ struct Cpu
 
     bool halted = false;
     bool inerrupts_master_enable_flag = true;
+    bool software_breakpoint = false;
 
+    // Keeping last_inst_str up to date formats every instruction
+    bool trace_instructions = true;
     std::string last_inst_str;
 
     std::uint8_t arg1;
@@ -84,5 +87,7 @@ struct Cpu
     std::size_t run_once();
 
     std::string state_str() const;
+
+    void serialize(SaveState &state);
 };
 
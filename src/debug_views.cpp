@@ -0,0 +1,195 @@
+#include "debug_views.h"
+
+#include "ppu.h"
+
+#include <algorithm>
+
+PpuDebugViews::PpuDebugViews(const std::uint32_t colors[4], std::uint32_t *tileset, std::uint32_t *tile_map, std::uint32_t *objects,
+                             std::uint32_t *object_layer)
+    : colors{ colors[0], colors[1], colors[2], colors[3] }
+    , tileset(tileset)
+    , tile_map(tile_map)
+    , objects(objects)
+    , object_layer(object_layer)
+{
+    std::fill(tileset, tileset + TILESET_WIDTH * TILESET_HEIGHT, colors[0]);
+    std::fill(objects, objects + OBJECTS_WIDTH * OBJECTS_HEIGHT, 0);
+    std::fill(object_layer, object_layer + OBJECT_LAYER_SIZE * OBJECT_LAYER_SIZE, 0);
+}
+
+// palette holds four 2-bit shades like BGP, 0xE4 shows the raw indices
+void PpuDebugViews::draw_tile(std::uint32_t *pixels, int width, int x, int y, const std::uint8_t rows[8][8], std::uint8_t palette)
+{
+    const std::uint32_t shades[4] = {
+        colors[palette & 3], colors[(palette >> 2) & 3], colors[(palette >> 4) & 3], colors[palette >> 6]
+    };
+
+    for (int row = 0; row < 8; ++row)
+    {
+        auto line = pixels + (y + row) * width + x;
+        for (int column = 0; column < 8; ++column)
+        {
+            line[column] = shades[rows[row][column]];
+        }
+    }
+    ++redrawn_tiles;
+}
+
+void PpuDebugViews::refresh(Ppu &ppu)
+{
+    redrawn_tiles = 0;
+    ppu.decode_dirty_tiles();
+
+    for (int tile = 0; tile < Ppu::TILE_COUNT; ++tile)
+    {
+        if (tileset_versions[tile] != ppu.tile_versions[tile])
+        {
+            tileset_versions[tile] = ppu.tile_versions[tile];
+            draw_tile(tileset, TILESET_WIDTH, tile % 20 * 8, tile / 20 * 8, ppu.decoded_tiles[0][tile], 0xE4);
+        }
+    }
+
+    const int settings = ppu.lcd_control.value << 8 | ppu.bg_palette_data.value;
+    if (settings != map_settings)
+    {
+        map_settings = settings;
+        for (auto &row : map_cells)
+        {
+            for (auto &cell : row)
+            {
+                cell.tile = -1;
+            }
+        }
+    }
+
+    const int tiles_before_map = redrawn_tiles;
+    const int map_offset = ppu.lcd_control.bg_tile_map_area == 0
+            ? 0x9800-0x8000
+            : 0x9C00-0x8000;
+
+    for (int tile_y = 0; tile_y < 32; ++tile_y)
+    {
+        for (int tile_x = 0; tile_x < 32; ++tile_x)
+        {
+            const int tile = ppu.tile_number(ppu.tile_index_on_map(map_offset, tile_x, tile_y), ppu.tiles_offset());
+            auto &cell = map_cells[tile_y][tile_x];
+            if (cell.tile == tile && cell.version == ppu.tile_versions[tile])
+            {
+                continue;
+            }
+
+            cell.tile = tile;
+            cell.version = ppu.tile_versions[tile];
+            draw_tile(tile_map, MAP_SIZE, tile_x * 8, tile_y * 8, ppu.decoded_tiles[0][tile], ppu.bg_palette_data.value);
+            for (int y = 0; y < 8; ++y)
+            {
+                std::copy_n(ppu.decoded_tiles[0][tile][y], 8, &tile_map_indices[tile_y * 8 + y][tile_x * 8]);
+            }
+        }
+    }
+
+    //Objects behind the background depend on the map under them
+    bool layer_dirty = redrawn_tiles != tiles_before_map || scroll_x != ppu.lcd_scroll_x || scroll_y != ppu.lcd_scroll_y;
+    scroll_x = ppu.lcd_scroll_x;
+    scroll_y = ppu.lcd_scroll_y;
+
+    const bool big_obj = ppu.lcd_control.big_obj;
+    for (int n = 0; n < 40; ++n)
+    {
+        const auto attributes = ppu.obj_attribute_memory + n*4;
+        const bool x_flip = attributes[3] & 0x20;
+        const bool y_flip = attributes[3] & 0x40;
+        const auto palette = ppu.obj_palette_data[(attributes[3] >> 4) & 1].value;
+        const int tile = big_obj ? attributes[2] & 0xFE : attributes[2];
+
+        ObjectCell cell;
+        cell.position = attributes[0] | attributes[1] << 8;
+        cell.attributes = attributes[2] | attributes[3] << 8 | palette << 16 | big_obj << 24;
+        cell.versions[0] = ppu.tile_versions[tile];
+        cell.versions[1] = big_obj ? ppu.tile_versions[tile + 1] : 0;
+        const bool changed = ! objects_drawn || ! (cell == object_cells[n]);
+        layer_dirty |= changed || cell.position != object_cells[n].position;
+        object_cells[n] = cell;
+        if ( ! changed)
+        {
+            continue;
+        }
+
+        const int x = n % 10 * 10;
+        const int y = n / 10 * 18;
+        const int height = big_obj ? 16 : 8;
+
+        //Rows in display order, flipped the way the object shows on screen
+        std::uint8_t rows[16][8];
+        for (int row = 0; row < height; ++row)
+        {
+            const int source = y_flip ? height - 1 - row : row;
+            std::copy_n(ppu.decoded_tiles[x_flip][tile + source / 8][source % 8], 8, rows[row]);
+        }
+        draw_tile(objects, OBJECTS_WIDTH, x, y, rows, palette);
+        if (big_obj)
+        {
+            draw_tile(objects, OBJECTS_WIDTH, x, y + 8, rows + 8, palette);
+        }
+        else
+        {
+            for (int row = 8; row < 16; ++row)
+            {
+                std::fill_n(objects + (y + row) * OBJECTS_WIDTH + x, 8, 0);
+            }
+        }
+    }
+    objects_drawn = true;
+
+    if (layer_dirty)
+    {
+        draw_object_layer(ppu);
+    }
+}
+
+void PpuDebugViews::draw_object_layer(const Ppu &ppu)
+{
+    const int size = OBJECT_LAYER_SIZE;
+
+    //Only what the objects covered last time needs clearing
+    for (const int position : layer_positions)
+    {
+        const int x = (position >> 8) - 8;
+        const int y = (position & 0xFF) - 16;
+        for (int row = std::max(0, y); row < std::min(size, y + layer_height); ++row)
+        {
+            std::fill(object_layer + row * size + std::max(0, x), object_layer + row * size + std::min(size, x + 8), 0);
+        }
+    }
+
+    const bool big_obj = ppu.lcd_control.big_obj;
+    const int height = big_obj ? 16 : 8;
+    for (int n = 0; n < 40; ++n)
+    {
+        const auto attributes = ppu.obj_attribute_memory + n*4;
+        const int tile = big_obj ? attributes[2] & 0xFE : attributes[2];
+        const bool x_flip = attributes[3] & 0x20;
+        const bool y_flip = attributes[3] & 0x40;
+        const bool behind_bg = attributes[3] & 0x80;
+        const auto palette = ppu.obj_palette_data[(attributes[3] >> 4) & 1];
+        layer_positions[n] = attributes[0] | attributes[1] << 8;
+
+        for (int y = 0; y < height; ++y)
+        {
+            const int row = y_flip ? height - 1 - y : y;
+            const int screen_y = attributes[0] - 16 + y;
+            for (int x = 0; x < 8; ++x)
+            {
+                const int screen_x = attributes[1] - 8 + x;
+                const auto pix = ppu.decoded_tiles[x_flip][tile + row / 8][row % 8][x];
+                if (pix == 0 || screen_x < 0 || screen_y < 0 || screen_x >= size || screen_y >= size
+                    || (behind_bg && tile_map_index(screen_x + scroll_x, screen_y + scroll_y) != 0))
+                {
+                    continue;
+                }
+                object_layer[screen_y * size + screen_x] = colors[palette[pix]];
+            }
+        }
+    }
+    layer_height = height;
+}
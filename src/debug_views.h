@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+
+class Ppu;
+
+// Tileset, background map and object views for the debugger, drawn into the
+// caller's 32-bit pixel buffers. A refresh only redraws the tiles whose data,
+// map entry or palette changed since the previous one.
+class PpuDebugViews
+{
+public:
+    // 20 tiles a row, in VRAM order
+    static const int TILESET_WIDTH = 160;
+    static const int TILESET_HEIGHT = 160;
+    // The background map as stored, not scrolled
+    static const int MAP_SIZE = 256;
+    // The 40 objects as 8x16 cells, 10 a row with a 2 pixel gap
+    static const int OBJECTS_WIDTH = 100;
+    static const int OBJECTS_HEIGHT = 72;
+    // The objects where they are on screen, to go over the map scrolled to the
+    // screen. Pixel value 0 where no object shows.
+    static const int OBJECT_LAYER_SIZE = MAP_SIZE;
+
+    // colors are the pixel values for shades 0-3
+    PpuDebugViews(const std::uint32_t colors[4], std::uint32_t *tileset, std::uint32_t *tile_map, std::uint32_t *objects,
+                  std::uint32_t *object_layer);
+
+    void refresh(Ppu &ppu);
+
+    // Color index of a background map pixel, objects with priority go behind 1-3
+    std::uint8_t tile_map_index(int x, int y) const { return tile_map_indices[y % MAP_SIZE][x % MAP_SIZE]; }
+
+    // Tiles drawn by the last refresh
+    int redrawn_tiles = 0;
+    // SCX and SCY the object layer was drawn for, the map goes with it
+    int scroll_x = 0;
+    int scroll_y = 0;
+
+private:
+    void draw_tile(std::uint32_t *pixels, int width, int x, int y, const std::uint8_t rows[8][8], std::uint8_t palette);
+    void draw_object_layer(const Ppu &ppu);
+
+    std::uint32_t colors[4];
+    std::uint32_t *tileset;
+    std::uint32_t *tile_map;
+    std::uint32_t *objects;
+    std::uint32_t *object_layer;
+
+    std::uint32_t tileset_versions[384] = {};
+
+    struct MapCell
+    {
+        int tile = -1;
+        std::uint32_t version = 0;
+    };
+    MapCell map_cells[32][32];
+    // LCDC and BGP as of the last map refresh, a change redraws the whole map
+    int map_settings = -1;
+    std::uint8_t tile_map_indices[MAP_SIZE][MAP_SIZE] = {};
+
+    struct ObjectCell
+    {
+        // Y and X from OAM, only the object layer cares
+        int position = 0;
+        std::uint32_t attributes = 0;
+        std::uint32_t versions[2] = {};
+        bool operator==(const ObjectCell &other) const
+        {
+            return attributes == other.attributes && versions[0] == other.versions[0] && versions[1] == other.versions[1];
+        }
+    };
+    ObjectCell object_cells[40];
+    bool objects_drawn = false;
+    // Y and X of each object and their height when the layer was drawn, cleared before the next
+    int layer_positions[40] = {};
+    int layer_height = 8;
+};
@@ -0,0 +1,121 @@
+#include "deferred_renderer.h"
+
+#include "save_state.h"
+
+DeferredRenderer::DeferredRenderer(Ppu &ppu) : shadow(ppu.bus), ppu(ppu)
+{
+    resync();
+    shadow.adopt_frames(ppu);
+}
+
+void DeferredRenderer::record_scan()
+{
+    if (line_count == LCD_HEIGHT)
+    {
+        return;
+    }
+
+    auto &line = lines[line_count];
+    line.y = ppu.line_y;
+    line.scanned = true;
+    line.scan_lcd_control = ppu.lcd_control.value;
+    line.scan_writes = writes.size();
+    scan_pending = true;
+}
+
+void DeferredRenderer::record_line()
+{
+    auto &line = lines[line_count++];
+
+    //Turned on or loaded halfway through a line, the shadow got its objects along with the rest
+    if ( ! scan_pending)
+    {
+        line.y = ppu.line_y;
+        line.scanned = false;
+        line.scan_writes = writes.size();
+    }
+
+    line.lcd_control = ppu.lcd_control.value;
+    line.scroll_x = ppu.lcd_scroll_x;
+    line.scroll_y = ppu.lcd_scroll_y;
+    line.window_x = ppu.window_x_pos;
+    line.window_y = ppu.window_y_pos;
+    line.bg_palette = ppu.bg_palette_data.value;
+    line.obj_palettes[0] = ppu.obj_palette_data[0].value;
+    line.obj_palettes[1] = ppu.obj_palette_data[1].value;
+    line.render_writes = writes.size();
+    scan_pending = false;
+}
+
+void DeferredRenderer::apply_writes(std::size_t end)
+{
+    for ( ; applied_writes < end; ++applied_writes)
+    {
+        const auto &write = writes[applied_writes];
+        if (write.address >= 0xFE00)
+        {
+            shadow.write(write.address, write.value);
+        }
+        else
+        {
+            shadow.write_vram(write.address - 0x8000, write.value);
+        }
+    }
+}
+
+void DeferredRenderer::flush()
+{
+    for (int i = 0; i < line_count; ++i)
+    {
+        const auto &line = lines[i];
+        shadow.line_y = line.y;
+
+        if (line.scanned)
+        {
+            apply_writes(line.scan_writes);
+            shadow.lcd_control.value = line.scan_lcd_control;
+            shadow.scan_oam();
+        }
+
+        apply_writes(line.render_writes);
+        shadow.lcd_control.value = line.lcd_control;
+        shadow.lcd_scroll_x = line.scroll_x;
+        shadow.lcd_scroll_y = line.scroll_y;
+        shadow.window_x_pos = line.window_x;
+        shadow.window_y_pos = line.window_y;
+        shadow.bg_palette_data.value = line.bg_palette;
+        shadow.obj_palette_data[0].value = line.obj_palettes[0];
+        shadow.obj_palette_data[1].value = line.obj_palettes[1];
+        shadow.render_current_scanline();
+        shadow.write_output_line();
+    }
+    line_count = 0;
+
+    //Whatever was written since keeps the shadow's memory current for the next frame
+    apply_writes(writes.size());
+    writes.clear();
+    applied_writes = 0;
+}
+
+void DeferredRenderer::end_frame(bool rendered)
+{
+    flush();
+    if (rendered)
+    {
+        shadow.swap_frame_buffers();
+    }
+}
+
+void DeferredRenderer::resync()
+{
+    //Lines recorded before a load were already on screen the synchronous way
+    flush();
+    scan_pending = false;
+
+    SaveState state;
+    state.begin_save();
+    ppu.serialize(state);
+    state.begin_load();
+    shadow.serialize(state);
+    shadow.copy_objects(ppu);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "ppu.h"
+
+#include <cstdint>
+#include <vector>
+
+// Draws a PPU's whole frame in one go at VBlank. During the frame the PPU only
+// notes the registers each line was drawn with and the VRAM and OAM writes in
+// between, a shadow PPU then catches up line by line. Raster effects come out
+// as they would drawing each line in mode 3.
+class DeferredRenderer
+{
+public:
+    explicit DeferredRenderer(Ppu &ppu);
+
+    // Everything a line is drawn with besides VRAM and OAM
+    struct Line
+    {
+        std::uint8_t y;
+        // Unset for a line scanned before the renderer took over
+        bool scanned;
+        // Object size as the mode 2 scan saw it
+        std::uint8_t scan_lcd_control;
+        std::uint8_t lcd_control;
+        std::uint8_t scroll_x;
+        std::uint8_t scroll_y;
+        std::uint8_t window_x;
+        std::uint8_t window_y;
+        std::uint8_t bg_palette;
+        std::uint8_t obj_palettes[2];
+        // Writes made before the scan and before drawing
+        std::uint32_t scan_writes;
+        std::uint32_t render_writes;
+    };
+
+    struct Write
+    {
+        std::uint16_t address; // 0x8000-0x9FFF or 0xFE00-0xFE9F
+        std::uint8_t value;
+    };
+
+    void record_write(std::uint16_t address, std::uint8_t value) { writes.push_back(Write{ address, value }); }
+    /// Mode 2 of a drawn line
+    void record_scan();
+    /// Mode 3 of a drawn line
+    void record_line();
+    /// Draws the recorded lines and, when the frame was drawn, hands it over
+    void end_frame(bool rendered);
+
+    /// Draws whatever was recorded so far and applies the writes after it
+    void flush();
+    /// Starts the shadow over from the PPU's current state, after a load
+    void resync();
+
+    // Owns the frame buffers and the output surface while deferred
+    Ppu shadow;
+
+private:
+    static const int LCD_HEIGHT = 144;
+
+    void apply_writes(std::size_t end);
+
+    Ppu &ppu;
+    std::vector<Write> writes;
+    std::size_t applied_writes = 0;
+    Line lines[LCD_HEIGHT];
+    int line_count = 0;
+    bool scan_pending = false;
+};
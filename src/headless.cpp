@@ -0,0 +1,226 @@
+#include "headless.h"
+
+#include "system.h"
+#include "audio_writer.h"
+#include "link_cable.h"
+#include "netplay.h"
+#include "lockstep.h"
+#include "snapshot_cache.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdlib>
+#include <memory>
+#include <random>
+
+static const std::uint64_t TICKS_PER_FRAME = 70224;
+
+std::unique_ptr<SocketLink> open_socket_link(const HeadlessOptions &options)
+{
+    if ( ! options.link_listen.empty())
+    {
+        std::cout << "Waiting for link on " << options.link_listen << std::endl;
+        return SocketLink::listen(options.link_listen);
+    }
+    if ( ! options.link_connect.empty())
+    {
+        return SocketLink::connect(options.link_connect);
+    }
+    return nullptr;
+}
+
+// Both players simulate the whole linked pair; only joypad inputs cross the wire
+static int run_netplay(const HeadlessOptions &options)
+{
+    if (options.link_rom_file.empty())
+    {
+        throw std::runtime_error("Netplay needs a second ROM for the linked pair");
+    }
+
+    System first(options.rom_file);
+    System second(options.link_rom_file);
+    first.cpu.trace_instructions = false;
+    second.cpu.trace_instructions = false;
+
+    NetplayTransport transport(options.netplay_port, options.netplay_peer_port);
+    RollbackSession session(first, second, options.netplay_player, transport);
+
+    //Scripted input, a new random button combination every half second
+    std::minstd_rand random(options.netplay_player + 1);
+    std::uint8_t input = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    while (session.frame() < options.frames)
+    {
+        if (session.frame() % 30 == 0)
+        {
+            input = random();
+        }
+        session.advance_frame(input);
+    }
+    session.synchronize();
+
+    const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+
+    SaveState final_state;
+    final_state.begin_save();
+    first.serialize(final_state);
+    second.serialize(final_state);
+
+    const auto &metrics = session.metrics;
+    std::cout << "Frames            : " << metrics.frames << "\n"
+              << "Wall time         : " << wall_time.count() << " s\n"
+              << "Rollbacks         : " << metrics.rollbacks << "\n"
+              << "Max rollback depth: " << metrics.max_rollback_depth << "\n"
+              << "Resimulated frames: " << metrics.resimulated_frames << " (" << metrics.resimulated_frames_per_second << "/s)\n"
+              << "Worst frame time  : " << metrics.worst_frame_time * 1000 << " ms\n"
+              << "State hash        : " << std::hex << std::setw(16) << std::setfill('0') << final_state.hash() << std::endl;
+
+    return EXIT_SUCCESS;
+}
+
+int run_headless(const HeadlessOptions &options)
+{
+    if (options.netplay_port)
+    {
+        return run_netplay(options);
+    }
+
+    if (options.lockstep_instances)
+    {
+        return run_lockstep_benchmark(options);
+    }
+
+    System system(options.rom_file, true, options.patch_file);
+    system.cpu.trace_instructions = false;
+    system.ppu.render_interval = options.render_interval;
+    system.ppu.set_threaded_rendering(options.threaded_rendering);
+    system.ppu.set_deferred_rendering(options.deferred_rendering);
+
+    std::unique_ptr<System> peer;
+    std::unique_ptr<LinkCable> link_cable;
+    if ( ! options.link_rom_file.empty())
+    {
+        peer = std::make_unique<System>(options.link_rom_file);
+        peer->cpu.trace_instructions = false;
+        link_cable = std::make_unique<LinkCable>(system, *peer);
+    }
+
+    //The first frames of an unlinked run are the same every time, so they can come from the cache.
+    //Not their audio though, which a cached start would leave out.
+    std::uint64_t first_frame = 0;
+    std::unique_ptr<SnapshotCache> snapshot_cache;
+    if ( ! options.snapshot_cache.empty() && ! peer && options.link_listen.empty() && options.link_connect.empty()
+        && options.audio_file.empty() && options.audio_hash_file.empty()
+        && options.warm_frames < options.frames)
+    {
+        snapshot_cache = std::make_unique<SnapshotCache>(options.snapshot_cache);
+        if (snapshot_cache->load(system, options.warm_frames))
+        {
+            std::cout << "Started from cached snapshot at frame " << options.warm_frames << std::endl;
+            first_frame = options.warm_frames;
+            snapshot_cache.reset();
+        }
+    }
+
+    auto socket_link = open_socket_link(options);
+    if (socket_link)
+    {
+        system.serial.link = socket_link.get();
+    }
+
+    std::unique_ptr<AudioWriter> audio_writer;
+    if ( ! options.audio_file.empty())
+    {
+        audio_writer = std::make_unique<AudioWriter>(options.audio_file, Apu::SAMPLE_RATE, Apu::CHANNELS);
+    }
+
+    std::unique_ptr<AudioHash> audio_hash;
+    if ( ! options.audio_hash_file.empty())
+    {
+        audio_hash = std::make_unique<AudioHash>(Apu::SAMPLE_RATE, Apu::CHANNELS);
+    }
+
+    system.apu.sample_output_enabled = audio_writer || audio_hash;
+    system.apu.samples.reserve(Apu::SAMPLE_RATE * Apu::CHANNELS / 30);
+
+    auto drain_samples = [&]
+    {
+        auto &samples = system.apu.samples;
+        if (audio_writer)
+        {
+            audio_writer->write(samples.data(), samples.size());
+        }
+        if (audio_hash)
+        {
+            audio_hash->update(samples.data(), samples.size());
+        }
+        samples.clear();
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (std::uint64_t frame = first_frame; frame < options.frames; )
+    {
+        if (snapshot_cache && frame == options.warm_frames)
+        {
+            snapshot_cache->store(system, options.warm_frames);
+            snapshot_cache.reset();
+        }
+
+        if (link_cable)
+        {
+            link_cable->run(TICKS_PER_FRAME);
+            system.ppu.frame_ready = true;
+            peer->ppu.frame_ready = false;
+        }
+        else
+        {
+            system.tick();
+        }
+
+        if (system.ppu.frame_ready)
+        {
+            system.ppu.frame_ready = false;
+            system.cart.poll_battery();
+            ++frame;
+            drain_samples();
+        }
+    }
+    drain_samples();
+
+    if (audio_writer)
+    {
+        audio_writer->close();
+    }
+
+    const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+    const double emulated_time = options.frames / 59.7275;
+
+    std::cout << "Frames   : " << options.frames << "\n"
+              << "Wall time: " << wall_time.count() << " s\n"
+              << "Speed    : " << emulated_time / wall_time.count() << "x\n"
+              << "Rendered : " << system.ppu.rendered_frames << " frames, " << system.ppu.skipped_frames << " skipped" << std::endl;
+
+    if (audio_hash)
+    {
+        audio_hash->finish();
+
+        std::ofstream hash_file;
+        if (options.audio_hash_file != "-")
+        {
+            hash_file.open(options.audio_hash_file);
+        }
+        std::ostream &out = hash_file.is_open() ? hash_file : std::cout;
+
+        for (std::size_t second=0; second<audio_hash->seconds.size(); ++second)
+        {
+            out << std::dec << second << " " << std::hex << std::setw(16) << std::setfill('0') << audio_hash->seconds[second] << "\n";
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
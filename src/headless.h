@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct HeadlessOptions
+{
+    std::string rom_file;
+    // IPS or BPS patch applied to rom_file, empty for none
+    std::string patch_file;
+    std::uint64_t frames = 60 * 60;
+
+    // .wav or raw PCM, empty to disable
+    std::string audio_file;
+    // One hash per emulated second, "-" for stdout, empty to disable
+    std::string audio_hash_file;
+
+    // Headless: frames are drawn once every render_interval frames, never when 0
+    int render_interval = 1;
+    // Lines are drawn on a worker thread alongside the emulation
+    bool threaded_rendering = false;
+    // Lines are drawn all at once at VBlank
+    bool deferred_rendering = false;
+
+    // GUI fast-forward speed, 0 for uncapped
+    int turbo_multiplier = 0;
+    // GUI: cartridge clocks follow emulated time instead of the host clock
+    bool deterministic_rtc = false;
+
+    // Second ROM linked to the first one in the same process
+    std::string link_rom_file;
+    // Unix socket link to another process
+    std::string link_listen;
+    std::string link_connect;
+
+    // Rollback netplay of the linked pair against another process on the loopback interface
+    int netplay_port = 0;
+    int netplay_peer_port = 0;
+    int netplay_player = 0;
+
+    // Instances of the ROM to run through LockstepEngine, 8 or 16
+    int lockstep_instances = 0;
+
+    // Directory of post-boot snapshots, empty to always boot from scratch
+    std::string snapshot_cache;
+    // Frames after power on at which the snapshot is taken
+    std::uint64_t warm_frames = 60;
+};
+
+class SocketLink;
+std::unique_ptr<SocketLink> open_socket_link(const HeadlessOptions &options);
+
+// Runs the emulator without a window for the given number of frames
+int run_headless(const HeadlessOptions &options);
@@ -4,6 +4,8 @@
 #include <array>
 #include <iomanip>
 #include <sstream>
+#include <type_traits>
+#include <utility>
 #include "operations.h"
 
 template<std::int8_t SIZE, std::uint8_t TICKS, typename Impl>
@@ -96,7 +98,7 @@ template<> struct Instruction<0x3D> : Inst<1,  4, DEC<A>> {};
 template<> struct Instruction<0x3E> : Inst<2,  8, LD<A,d8>> {};
 template<> struct Instruction<0x3F> : Inst<1,  4, CCF> {};
 
-template<> struct Instruction<0x40> : Inst<1, 4, LD<B,B>> {};
+template<> struct Instruction<0x40> : Inst<1, 4, BREAKPOINT> {};
 template<> struct Instruction<0x41> : Inst<1, 4, LD<B,C>> {};
 template<> struct Instruction<0x42> : Inst<1, 4, LD<B,D>> {};
 template<> struct Instruction<0x43> : Inst<1, 4, LD<B,E>> {};
@@ -571,3 +573,21 @@ template<> struct Instruction<0xCBFC> : Inst<2,  8, SET<7, H>> {};
 template<> struct Instruction<0xCBFD> : Inst<2,  8, SET<7, L>> {};
 template<> struct Instruction<0xCBFE> : Inst<2, 16, SET<7, At<HL>>> {};
 template<> struct Instruction<0xCBFF> : Inst<2,  8, SET<7, A>> {};
+
+// Per opcode tables for code that decodes the instruction stream itself.
+// Conditional instructions and the CB prefix have 0 ticks, invalid opcodes have size 0.
+template<std::uint16_t Base, std::size_t... N>
+constexpr std::array<std::uint8_t, sizeof...(N)> instruction_ticks_table(std::index_sequence<N...>)
+{
+    return {{ std::uint8_t(Instruction<Base + N>::ticks)... }};
+}
+
+template<std::size_t... N>
+constexpr std::array<std::uint8_t, sizeof...(N)> instruction_size_table(std::index_sequence<N...>)
+{
+    return {{ std::uint8_t(std::is_same_v<typename Instruction<N>::impl_type, INVALID> ? 0 : Instruction<N>::size)... }};
+}
+
+inline constexpr auto INSTRUCTION_TICKS = instruction_ticks_table<0x00>(std::make_index_sequence<256>());
+inline constexpr auto CB_INSTRUCTION_TICKS = instruction_ticks_table<0xCB00>(std::make_index_sequence<256>());
+inline constexpr auto INSTRUCTION_SIZES = instruction_size_table(std::make_index_sequence<256>());
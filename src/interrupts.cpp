@@ -1,4 +1,5 @@
 #include "interrupts.h"
+#include "save_state.h"
 
 void Interrupts::trigger_interrupt(Type interrupt)
 {
@@ -39,3 +40,8 @@ int Interrupts::active_interrupt_address()
 
     return 0;
 }
+
+void Interrupts::serialize(SaveState &state)
+{
+    state(trigger_register)(enable_register);
+}
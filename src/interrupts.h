@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+class SaveState;
+
 struct Interrupts
 {
     enum Type {
@@ -16,6 +18,7 @@ struct Interrupts
     std::uint8_t enable_register = 0; //0xFFFF
 
     void trigger_interrupt(Type interrupt);
+    void serialize(SaveState &state);
     int active_interrupt_address();
 };
 
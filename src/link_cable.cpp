@@ -0,0 +1,223 @@
+#include "link_cable.h"
+#include "save_state.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+LinkCable::LinkCable(System &first, System &second)
+    : systems{ &first, &second }
+{
+    ends[0].peer = &second.serial;
+    ends[1].peer = &first.serial;
+
+    for (int i=0; i<2; ++i)
+    {
+        systems[i]->serial.link = &ends[i];
+        systems[i]->serial.defer_completion = true;
+    }
+}
+
+LinkCable::~LinkCable()
+{
+    for (auto system : systems)
+    {
+        system->serial.link = nullptr;
+        system->serial.defer_completion = false;
+    }
+}
+
+void LinkCable::run(std::uint64_t ticks)
+{
+    end_time += ticks;
+
+    while (true)
+    {
+        //A transfer completes once the peer has caught up with it
+        for (int i=0; i<2; ++i)
+        {
+            if (systems[i]->serial.completion_pending && clocks[1-i] >= clocks[i])
+            {
+                systems[i]->serial.complete_transfer();
+            }
+        }
+
+        const int lag = clocks[0] <= clocks[1] ? 0 : 1;
+        const int lead = 1 - lag;
+
+        if (clocks[lag] >= end_time)
+        {
+            return;
+        }
+
+        //Anything the leading system starts can't complete within TRANSFER_TICKS,
+        //so the lagging one may run that far past it without missing an exchange
+        auto limit = std::min(end_time, clocks[lead] + Serial::TRANSFER_TICKS);
+        if (systems[lead]->serial.completion_pending)
+        {
+            limit = std::min(limit, clocks[lead]);
+        }
+
+        auto &system = *systems[lag];
+        while (clocks[lag] < limit && ! system.serial.completion_pending)
+        {
+            clocks[lag] += system.tick();
+        }
+    }
+}
+
+void LinkCable::serialize(SaveState &state)
+{
+    systems[0]->serialize(state);
+    systems[1]->serialize(state);
+    state(clocks)(end_time);
+}
+
+enum LinkMessage : std::uint8_t {
+    TRANSFER = 1,
+    REPLY = 2,
+};
+
+static const int EXCHANGE_TIMEOUT_MS = 1000;
+
+static sockaddr_un socket_address(const std::string &path)
+{
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+std::unique_ptr<SocketLink> SocketLink::listen(const std::string &path)
+{
+    auto address = socket_address(path);
+
+    int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    if (server < 0
+        || ::bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+        || ::listen(server, 1) < 0)
+    {
+        throw std::runtime_error("Unable to listen on " + path + ": " + std::strerror(errno));
+    }
+
+    int fd = ::accept(server, nullptr, nullptr);
+    ::close(server);
+    ::unlink(path.c_str());
+
+    if (fd < 0)
+    {
+        throw std::runtime_error("Unable to accept link on " + path + ": " + std::strerror(errno));
+    }
+
+    return std::unique_ptr<SocketLink>(new SocketLink(fd));
+}
+
+std::unique_ptr<SocketLink> SocketLink::connect(const std::string &path)
+{
+    auto address = socket_address(path);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        throw std::runtime_error("Unable to connect to " + path + ": " + std::strerror(errno));
+    }
+
+    return std::unique_ptr<SocketLink>(new SocketLink(fd));
+}
+
+SocketLink::~SocketLink()
+{
+    disconnect();
+}
+
+void SocketLink::disconnect()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool SocketLink::send_message(std::uint8_t type, std::uint8_t data)
+{
+    const std::uint8_t message[2] = { type, data };
+    if (fd < 0 || ::send(fd, message, sizeof(message), MSG_NOSIGNAL) != sizeof(message))
+    {
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+bool SocketLink::receive_message(std::uint8_t &type, std::uint8_t &data, int timeout_ms)
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    pollfd request { fd, POLLIN, 0 };
+    if (::poll(&request, 1, timeout_ms) <= 0)
+    {
+        return false;
+    }
+
+    std::uint8_t message[2];
+    if (::recv(fd, message, sizeof(message), MSG_WAITALL) != sizeof(message))
+    {
+        disconnect();
+        return false;
+    }
+
+    type = message[0];
+    data = message[1];
+    return true;
+}
+
+std::uint8_t SocketLink::exchange(Serial &serial, std::uint8_t data)
+{
+    if ( ! send_message(TRANSFER, data))
+    {
+        return 0xFF;
+    }
+
+    std::uint8_t type;
+    std::uint8_t in;
+    while (receive_message(type, in, EXCHANGE_TIMEOUT_MS))
+    {
+        if (type == REPLY)
+        {
+            return in;
+        }
+
+        //Both sides started a transfer with their internal clock
+        send_message(REPLY, serial.external_transfer(in));
+    }
+
+    return 0xFF;
+}
+
+void SocketLink::poll(Serial &serial)
+{
+    std::uint8_t type;
+    std::uint8_t in;
+    while (receive_message(type, in, 0))
+    {
+        if (type == TRANSFER)
+        {
+            send_message(REPLY, serial.external_transfer(in));
+        }
+    }
+}
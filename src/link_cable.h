@@ -0,0 +1,64 @@
+#pragma once
+
+#include "system.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Two System instances in the same process connected by a link cable.
+// Both are advanced from the calling thread in turns, and only have to meet
+// at the moment a transfer completes, not on every cycle.
+class LinkCable
+{
+public:
+    LinkCable(System &first, System &second);
+    ~LinkCable();
+
+    // Advances both systems by the given number of ticks
+    void run(std::uint64_t ticks);
+
+    // Both systems and the cable's own clocks
+    void serialize(SaveState &state);
+
+    std::uint64_t clocks[2] = { 0, 0 };
+
+private:
+    struct End : LinkPort
+    {
+        Serial *peer = nullptr;
+
+        std::uint8_t exchange(Serial &, std::uint8_t data) override
+        {
+            return peer->external_transfer(data);
+        }
+    };
+
+    System *systems[2];
+    End ends[2];
+    std::uint64_t end_time = 0;
+};
+
+// Link cable over a Unix domain socket, for two processes on the same host.
+// The side driving the clock sends its byte and blocks for the reply, the
+// other side answers from poll() between instructions.
+class SocketLink : public LinkPort
+{
+public:
+    static std::unique_ptr<SocketLink> listen(const std::string &path);
+    static std::unique_ptr<SocketLink> connect(const std::string &path);
+
+    ~SocketLink() override;
+
+    std::uint8_t exchange(Serial &serial, std::uint8_t data) override;
+    void poll(Serial &serial) override;
+
+private:
+    explicit SocketLink(int fd) : fd(fd) {}
+
+    bool send_message(std::uint8_t type, std::uint8_t data);
+    bool receive_message(std::uint8_t &type, std::uint8_t &data, int timeout_ms);
+    void disconnect();
+
+    int fd;
+};
@@ -0,0 +1,913 @@
+#include "lockstep.h"
+
+#include "headless.h"
+#include "instructions.h"
+#include "netplay.h"
+#include "save_state.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+//The lane loops are written so the compiler can vectorize them, build them for AVX2 as well
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LANE_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LANE_TARGETS
+#endif
+
+static const std::uint64_t TICKS_PER_FRAME = 70224;
+
+static const std::uint8_t FLAG_Z = 0x80;
+static const std::uint8_t FLAG_N = 0x40;
+static const std::uint8_t FLAG_H = 0x20;
+static const std::uint8_t FLAG_C = 0x10;
+
+enum { REG_B, REG_C, REG_D, REG_E, REG_H, REG_L, REG_HL, REG_A };
+
+template<typename F>
+static void for_each_lane(std::uint32_t lanes, F f)
+{
+    for (; lanes; lanes &= lanes - 1)
+    {
+        f(__builtin_ctz(lanes));
+    }
+}
+
+template<int LANES>
+LockstepEngine<LANES>::LockstepEngine(const std::string &rom_file, const std::string &patch_file)
+{
+    for (int i=0; i<LANES; ++i)
+    {
+        systems.push_back(std::make_unique<System>(rom_file, false, patch_file));
+        systems.back()->cpu.trace_instructions = false;
+    }
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::load_group()
+{
+    for_each_lane(group, [&](int i)
+    {
+        const auto &r = systems[i]->cpu.registers;
+        registers[REG_B][i] = r.b;
+        registers[REG_C][i] = r.c;
+        registers[REG_D][i] = r.d;
+        registers[REG_E][i] = r.e;
+        registers[REG_H][i] = r.h;
+        registers[REG_L][i] = r.l;
+        registers[REG_A][i] = r.a;
+        f[i] = r.f;
+        sp[i] = r.sp;
+    });
+
+    const auto &cpu = systems[leader()]->cpu;
+    pc = cpu.registers.pc;
+    arg1 = cpu.arg1;
+    arg2 = cpu.arg2;
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::store_group()
+{
+    for_each_lane(group, [&](int i)
+    {
+        auto &cpu = systems[i]->cpu;
+        auto &r = cpu.registers;
+        r.b = registers[REG_B][i];
+        r.c = registers[REG_C][i];
+        r.d = registers[REG_D][i];
+        r.e = registers[REG_E][i];
+        r.h = registers[REG_H][i];
+        r.l = registers[REG_L][i];
+        r.a = registers[REG_A][i];
+        r.f = f[i];
+        r.sp = sp[i];
+        r.pc = pc;
+        cpu.arg1 = arg1;
+        cpu.arg2 = arg2;
+    });
+}
+
+template<int LANES>
+bool LockstepEngine<LANES>::needs_scalar() const
+{
+    bool scalar = false;
+    for_each_lane(group, [&](int i)
+    {
+        const auto &system = *systems[i];
+        scalar |= system.cpu.halted
+               || (system.cpu.inerrupts_master_enable_flag
+                   && (system.interrupts.enable_register & system.interrupts.trigger_register & 0x1F));
+    });
+    return scalar;
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::catch_up(int i, std::uint64_t until)
+{
+    while (clocks[i] < until)
+    {
+        clocks[i] += systems[i]->tick();
+        ++scalar_instructions;
+    }
+}
+
+// Runs the next instruction through every instance's own Cpu, then regroups:
+// instances that ended up elsewhere leave, split off instances that caught up
+// to the same PC on the same cycle come back.
+template<int LANES>
+void LockstepEngine<LANES>::step_scalar()
+{
+    store_group();
+    for_each_lane(group, [&](int i)
+    {
+        clocks[i] += systems[i]->tick();
+        ++scalar_instructions;
+    });
+
+    const int first = leader();
+    const auto &cpu = systems[first]->cpu;
+    const std::uint32_t all = (std::uint64_t(1) << LANES) - 1;
+
+    for_each_lane(all & ~group, [&](int i)
+    {
+        catch_up(i, clocks[first]);
+    });
+
+    for_each_lane(all, [&](int i)
+    {
+        const auto &other = systems[i]->cpu;
+        const bool together = clocks[i] == clocks[first]
+                && other.registers.pc == cpu.registers.pc
+                && other.halted == cpu.halted;
+
+        group = together ? group | (1u << i) : group & ~(1u << i);
+    });
+
+    load_group();
+    scalar_next = needs_scalar();
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::run(std::uint64_t ticks)
+{
+    target += ticks;
+
+    load_group();
+    scalar_next = needs_scalar();
+
+    while (clocks[leader()] < target)
+    {
+        std::size_t vector_ticks = 0;
+        if ( ! scalar_next)
+        {
+            vector_ticks = step_vector();
+        }
+
+        if ( ! vector_ticks)
+        {
+            step_scalar();
+            continue;
+        }
+
+        for_each_lane(group, [&](int i)
+        {
+            systems[i]->run_peripherals(vector_ticks);
+            clocks[i] += vector_ticks;
+        });
+        vector_instructions += __builtin_popcount(group);
+        scalar_next = needs_scalar();
+    }
+
+    store_group();
+
+    for (int i=0; i<LANES; ++i)
+    {
+        catch_up(i, target);
+    }
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::read_lanes(const std::uint16_t *addresses, std::uint8_t *values)
+{
+    for_each_lane(group, [&](int i)
+    {
+        values[i] = systems[i]->bus.read(addresses[i]);
+    });
+}
+
+template<int LANES>
+void LockstepEngine<LANES>::write_lanes(const std::uint16_t *addresses, const std::uint8_t *values)
+{
+    for_each_lane(group, [&](int i)
+    {
+        systems[i]->bus.write(addresses[i], values[i]);
+    });
+}
+
+/// Collects HL for each lane, then moves HL by step as (HL+) and (HL-) do
+template<int LANES>
+LANE_TARGETS
+void LockstepEngine<LANES>::hl_addresses(std::uint16_t *addresses, int step)
+{
+    for (int i=0; i<LANES; ++i)
+    {
+        addresses[i] = registers[REG_H][i] << 8 | registers[REG_L][i];
+        const std::uint16_t hl = addresses[i] + step;
+        registers[REG_H][i] = hl >> 8;
+        registers[REG_L][i] = hl & 0xFF;
+    }
+}
+
+/// False if the lanes disagree on the condition
+template<int LANES>
+bool LockstepEngine<LANES>::condition(int code, bool &taken) const
+{
+    static const std::uint8_t masks[4] = { FLAG_Z, FLAG_Z, FLAG_C, FLAG_C };
+    static const std::uint8_t expected[4] = { 0, FLAG_Z, 0, FLAG_C };
+
+    int taken_count = 0;
+    for_each_lane(group, [&](int i)
+    {
+        taken_count += (f[i] & masks[code]) == expected[code];
+    });
+
+    taken = taken_count;
+    return taken_count == 0 || taken_count == __builtin_popcount(group);
+}
+
+/// ADD ADC SUB SBC AND XOR OR CP, A with values
+template<int LANES>
+LANE_TARGETS
+void LockstepEngine<LANES>::alu(int operation, const std::uint8_t *values)
+{
+    auto *a = registers[REG_A];
+
+    switch (operation)
+    {
+        case 0:
+        case 1:
+            for (int i=0; i<LANES; ++i)
+            {
+                const unsigned carry = operation == 1 ? (f[i] >> 4) & 1 : 0;
+                const unsigned result = a[i] + values[i] + carry;
+                f[i] = (f[i] & 0x0F)
+                     | ((result & 0xFF) == 0 ? FLAG_Z : 0)
+                     | ((a[i] & 0xF) + (values[i] & 0xF) + carry > 0xF ? FLAG_H : 0)
+                     | (result > 0xFF ? FLAG_C : 0);
+                a[i] = result;
+            }
+            break;
+
+        case 2:
+        case 3:
+        case 7:
+            for (int i=0; i<LANES; ++i)
+            {
+                const int carry = operation == 3 ? (f[i] >> 4) & 1 : 0;
+                const int result = a[i] - values[i] - carry;
+                f[i] = (f[i] & 0x0F)
+                     | ((result & 0xFF) == 0 ? FLAG_Z : 0)
+                     | FLAG_N
+                     | ((a[i] & 0xF) - (values[i] & 0xF) - carry < 0 ? FLAG_H : 0)
+                     | (result < 0 ? FLAG_C : 0);
+                if (operation != 7)
+                {
+                    a[i] = result;
+                }
+            }
+            break;
+
+        case 4:
+            for (int i=0; i<LANES; ++i)
+            {
+                a[i] &= values[i];
+                f[i] = (a[i] == 0 ? FLAG_Z : 0) | FLAG_H;
+            }
+            break;
+
+        case 5:
+            for (int i=0; i<LANES; ++i)
+            {
+                a[i] ^= values[i];
+                f[i] = a[i] == 0 ? FLAG_Z : 0;
+            }
+            break;
+
+        case 6:
+            for (int i=0; i<LANES; ++i)
+            {
+                a[i] |= values[i];
+                f[i] = a[i] == 0 ? FLAG_Z : 0;
+            }
+            break;
+    }
+}
+
+template<int LANES>
+LANE_TARGETS
+void LockstepEngine<LANES>::inc_dec(std::uint8_t *values, bool decrement)
+{
+    for (int i=0; i<LANES; ++i)
+    {
+        const std::uint8_t result = values[i] + (decrement ? -1 : 1);
+        f[i] = (f[i] & (FLAG_C | 0x0F))
+             | (result == 0 ? FLAG_Z : 0)
+             | (decrement ? FLAG_N : 0)
+             | ((result & 0xF) == (decrement ? 0xF : 0) ? FLAG_H : 0);
+        values[i] = result;
+    }
+}
+
+/// RLC RRC RL RR SLA SRA SWAP SRL
+template<int LANES>
+LANE_TARGETS
+void LockstepEngine<LANES>::rotate_shift(int operation, std::uint8_t *values)
+{
+    for (int i=0; i<LANES; ++i)
+    {
+        const std::uint8_t value = values[i];
+        const std::uint8_t carry_in = (f[i] >> 4) & 1;
+        std::uint8_t result = 0;
+        bool carry = false;
+
+        switch (operation)
+        {
+            case 0: result = value << 1 | value >> 7;          carry = value & 0x80; break;
+            case 1: result = value >> 1 | value << 7;          carry = value & 0x01; break;
+            case 2: result = value << 1 | carry_in;            carry = value & 0x80; break;
+            case 3: result = value >> 1 | carry_in << 7;       carry = value & 0x01; break;
+            case 4: result = value << 1;                       carry = value & 0x80; break;
+            case 5: result = std::int8_t(value) >> 1;          carry = value & 0x01; break;
+            case 6: result = value << 4 | value >> 4;          carry = false;        break;
+            case 7: result = value >> 1;                       carry = value & 0x01; break;
+        }
+
+        f[i] = (result == 0 ? FLAG_Z : 0) | (carry ? FLAG_C : 0);
+        values[i] = result;
+    }
+}
+
+/// Executes the instruction at pc for the whole group and returns its ticks,
+/// or 0 without touching any state if it has to go through the scalar Cpus
+template<int LANES>
+LANE_TARGETS
+std::size_t LockstepEngine<LANES>::step_vector()
+{
+    //Nothing executes from OAM or I/O
+    if (0xFE00 <= pc && pc < 0xFF80)
+    {
+        return 0;
+    }
+
+    //Banked ROM and RAM can differ between instances, so every one of them has to see the same bytes
+    std::uint8_t bytes[3] = {0};
+    const int first = leader();
+    const int size = INSTRUCTION_SIZES[systems[first]->bus.read(pc)];
+    for (int n=0; n<size; ++n)
+    {
+        bytes[n] = systems[first]->bus.read(pc + n);
+    }
+
+    bool same_instruction = true;
+    for_each_lane(group & ~(1u << first), [&](int i)
+    {
+        for (int n=0; n<size; ++n)
+        {
+            same_instruction &= systems[i]->bus.read(pc + n) == bytes[n];
+        }
+    });
+    if ( ! same_instruction || size == 0)
+    {
+        return 0;
+    }
+
+    const std::uint8_t opcode = bytes[0];
+    const std::uint8_t d8 = bytes[1];
+    const std::uint16_t d16 = bytes[1] | bytes[2] << 8;
+
+    std::uint16_t next_pc = pc + size;
+    std::size_t ticks = INSTRUCTION_TICKS[opcode];
+
+    alignas(32) std::uint16_t addresses[LANES];
+    alignas(32) std::uint16_t words[LANES];
+    alignas(32) std::uint8_t values[LANES];
+    bool taken = false;
+
+    auto fill = [](auto *lanes, auto value)
+    {
+        for (int i=0; i<LANES; ++i)
+        {
+            lanes[i] = value;
+        }
+    };
+
+    //BC DE HL SP, as the 16 bit instructions encode them
+    auto pair = [&](int code, int i) -> std::uint16_t
+    {
+        if (code == 3)
+        {
+            return sp[i];
+        }
+        return registers[2*code][i] << 8 | registers[2*code + 1][i];
+    };
+    auto set_pair = [&](int code, int i, std::uint16_t value)
+    {
+        if (code == 3)
+        {
+            sp[i] = value;
+            return;
+        }
+        registers[2*code][i] = value >> 8;
+        registers[2*code + 1][i] = value & 0xFF;
+    };
+
+    auto push = [&](const std::uint16_t *values16)
+    {
+        for_each_lane(group, [&](int i)
+        {
+            sp[i] -= 2;
+            systems[i]->bus.write16(sp[i], values16[i]);
+        });
+    };
+
+    //Reads the top of the stack without popping it
+    auto peek = [&](std::uint16_t *values16)
+    {
+        for_each_lane(group, [&](int i)
+        {
+            values16[i] = systems[i]->bus.read16(sp[i]);
+        });
+    };
+
+    auto uniform = [&](const std::uint16_t *values16)
+    {
+        bool same = true;
+        for_each_lane(group, [&](int i)
+        {
+            same &= values16[i] == values16[first];
+        });
+        return same;
+    };
+
+    //LD r,r' with (HL) on either side, except HALT and the LD B,B breakpoint
+    if (0x40 <= opcode && opcode <= 0x7F)
+    {
+        if (opcode == 0x76 || opcode == 0x40)
+        {
+            return 0;
+        }
+
+        const int dst = (opcode >> 3) & 7;
+        const int src = opcode & 7;
+
+        if (src == REG_HL || dst == REG_HL)
+        {
+            hl_addresses(addresses, 0);
+        }
+        if (src == REG_HL)
+        {
+            read_lanes(addresses, registers[REG_HL]);
+        }
+        for (int i=0; i<LANES; ++i)
+        {
+            registers[dst][i] = registers[src][i];
+        }
+        if (dst == REG_HL)
+        {
+            write_lanes(addresses, registers[REG_HL]);
+        }
+    }
+    //ALU A,r
+    else if (0x80 <= opcode && opcode <= 0xBF)
+    {
+        if ((opcode & 7) == REG_HL)
+        {
+            hl_addresses(addresses, 0);
+            read_lanes(addresses, registers[REG_HL]);
+        }
+        alu((opcode >> 3) & 7, registers[opcode & 7]);
+    }
+    else switch (opcode)
+    {
+        case 0x00: //NOP
+            break;
+
+        //LD r,d8
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+            fill(registers[(opcode >> 3) & 7], d8);
+            break;
+
+        case 0x36: //LD (HL),d8
+            fill(registers[REG_HL], d8);
+            hl_addresses(addresses, 0);
+            write_lanes(addresses, registers[REG_HL]);
+            break;
+
+        //LD rr,d16
+        case 0x01: case 0x11: case 0x21: case 0x31:
+            for (int i=0; i<LANES; ++i)
+            {
+                set_pair(opcode >> 4, i, d16);
+            }
+            break;
+
+        //INC r, DEC r
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
+        case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+        {
+            const int reg = (opcode >> 3) & 7;
+            if (reg == REG_HL)
+            {
+                hl_addresses(addresses, 0);
+                read_lanes(addresses, registers[REG_HL]);
+            }
+            inc_dec(registers[reg], opcode & 1);
+            if (reg == REG_HL)
+            {
+                write_lanes(addresses, registers[REG_HL]);
+            }
+            break;
+        }
+
+        //INC rr, DEC rr
+        case 0x03: case 0x13: case 0x23: case 0x33:
+        case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+            for (int i=0; i<LANES; ++i)
+            {
+                set_pair(opcode >> 4, i, pair(opcode >> 4, i) + ((opcode & 0x8) ? -1 : 1));
+            }
+            break;
+
+        //ADD HL,rr
+        case 0x09: case 0x19: case 0x29: case 0x39:
+            for (int i=0; i<LANES; ++i)
+            {
+                const unsigned hl = pair(2, i);
+                const unsigned value = pair(opcode >> 4, i);
+                const unsigned result = hl + value;
+                f[i] = (f[i] & (FLAG_Z | 0x0F))
+                     | ((hl & 0xFFF) + (value & 0xFFF) > 0xFFF ? FLAG_H : 0)
+                     | (result > 0xFFFF ? FLAG_C : 0);
+                set_pair(2, i, result);
+            }
+            break;
+
+        //LD (BC),A  LD (DE),A  LD A,(BC)  LD A,(DE)
+        case 0x02: case 0x12: case 0x0A: case 0x1A:
+            for (int i=0; i<LANES; ++i)
+            {
+                addresses[i] = pair(opcode >> 4, i);
+            }
+            if (opcode & 0x8)
+            {
+                read_lanes(addresses, registers[REG_A]);
+            }
+            else
+            {
+                write_lanes(addresses, registers[REG_A]);
+            }
+            break;
+
+        //LD (HL+),A  LD (HL-),A  LD A,(HL+)  LD A,(HL-)
+        case 0x22: case 0x32: case 0x2A: case 0x3A:
+            hl_addresses(addresses, opcode < 0x30 ? 1 : -1);
+            if (opcode & 0x8)
+            {
+                read_lanes(addresses, registers[REG_A]);
+            }
+            else
+            {
+                write_lanes(addresses, registers[REG_A]);
+            }
+            break;
+
+        //RLCA RRCA RLA RRA
+        case 0x07: case 0x0F: case 0x17: case 0x1F:
+            rotate_shift(opcode >> 3, registers[REG_A]);
+            for (int i=0; i<LANES; ++i)
+            {
+                f[i] &= ~FLAG_Z;
+            }
+            break;
+
+        case 0x2F: //CPL
+            for (int i=0; i<LANES; ++i)
+            {
+                registers[REG_A][i] = ~registers[REG_A][i];
+                f[i] |= FLAG_N | FLAG_H;
+            }
+            break;
+
+        case 0x37: //SCF
+            for (int i=0; i<LANES; ++i)
+            {
+                f[i] = (f[i] & (FLAG_Z | 0x0F)) | FLAG_C;
+            }
+            break;
+
+        case 0x3F: //CCF
+            for (int i=0; i<LANES; ++i)
+            {
+                f[i] = (f[i] & (FLAG_Z | FLAG_C | 0x0F)) ^ FLAG_C;
+            }
+            break;
+
+        case 0x18: //JR r8
+            next_pc += std::int8_t(d8);
+            break;
+
+        //JR cc,r8
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            if ( ! condition((opcode >> 3) & 3, taken))
+            {
+                return 0;
+            }
+            if (taken)
+            {
+                next_pc += std::int8_t(d8);
+            }
+            ticks = taken ? 12 : 8;
+            break;
+
+        case 0xC3: //JP a16
+            next_pc = d16;
+            break;
+
+        //JP cc,a16
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            if ( ! condition((opcode >> 3) & 3, taken))
+            {
+                return 0;
+            }
+            if (taken)
+            {
+                next_pc = d16;
+            }
+            ticks = taken ? 16 : 12;
+            break;
+
+        case 0xE9: //JP (HL)
+            hl_addresses(addresses, 0);
+            if ( ! uniform(addresses))
+            {
+                return 0;
+            }
+            next_pc = addresses[first];
+            break;
+
+        //CALL a16, CALL cc,a16
+        case 0xCD:
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+            if (opcode != 0xCD && ! condition((opcode >> 3) & 3, taken))
+            {
+                return 0;
+            }
+            if (opcode == 0xCD || taken)
+            {
+                fill(words, next_pc);
+                push(words);
+                next_pc = d16;
+            }
+            ticks = opcode == 0xCD || taken ? 24 : 12;
+            break;
+
+        //RET, RET cc
+        case 0xC9:
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+            if (opcode != 0xC9 && ! condition((opcode >> 3) & 3, taken))
+            {
+                return 0;
+            }
+            if (opcode == 0xC9 || taken)
+            {
+                peek(words);
+                if ( ! uniform(words))
+                {
+                    return 0;
+                }
+                for (int i=0; i<LANES; ++i)
+                {
+                    sp[i] += 2;
+                }
+                next_pc = words[first];
+            }
+            if (opcode != 0xC9)
+            {
+                ticks = taken ? 20 : 8;
+            }
+            break;
+
+        //PUSH rr
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+            for (int i=0; i<LANES; ++i)
+            {
+                words[i] = opcode == 0xF5
+                        ? registers[REG_A][i] << 8 | f[i]
+                        : pair((opcode >> 4) & 3, i);
+            }
+            push(words);
+            break;
+
+        //POP rr
+        case 0xC1: case 0xD1: case 0xE1: case 0xF1:
+            peek(words);
+            for (int i=0; i<LANES; ++i)
+            {
+                sp[i] += 2;
+                if (opcode == 0xF1)
+                {
+                    registers[REG_A][i] = words[i] >> 8;
+                    f[i] = words[i] & 0xF0;
+                }
+                else
+                {
+                    set_pair((opcode >> 4) & 3, i, words[i]);
+                }
+            }
+            break;
+
+        //LDH (a8),A  LDH A,(a8)  LD (a16),A  LD A,(a16)
+        case 0xE0: case 0xF0: case 0xEA: case 0xFA:
+            fill(addresses, std::uint16_t((opcode & 0xF) == 0xA ? d16 : 0xFF00 + d8));
+            if (opcode & 0x10)
+            {
+                read_lanes(addresses, registers[REG_A]);
+            }
+            else
+            {
+                write_lanes(addresses, registers[REG_A]);
+            }
+            break;
+
+        //LD (C),A  LD A,(C)
+        case 0xE2: case 0xF2:
+            for (int i=0; i<LANES; ++i)
+            {
+                addresses[i] = 0xFF00 + registers[REG_C][i];
+            }
+            if (opcode & 0x10)
+            {
+                read_lanes(addresses, registers[REG_A]);
+            }
+            else
+            {
+                write_lanes(addresses, registers[REG_A]);
+            }
+            break;
+
+        //ALU A,d8
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            fill(values, d8);
+            alu((opcode >> 3) & 7, values);
+            break;
+
+        case 0xCB:
+        {
+            const int reg = d8 & 7;
+            const int bit = (d8 >> 3) & 7;
+            ticks = CB_INSTRUCTION_TICKS[d8];
+
+            if (reg == REG_HL)
+            {
+                hl_addresses(addresses, 0);
+                read_lanes(addresses, registers[REG_HL]);
+            }
+
+            auto *operand = registers[reg];
+            switch (d8 >> 6)
+            {
+                case 0:
+                    rotate_shift(bit, operand);
+                    break;
+                case 1: //BIT
+                    for (int i=0; i<LANES; ++i)
+                    {
+                        f[i] = (f[i] & (FLAG_C | 0x0F))
+                             | (operand[i] & (1 << bit) ? 0 : FLAG_Z)
+                             | FLAG_H;
+                    }
+                    break;
+                case 2: //RES
+                    for (int i=0; i<LANES; ++i)
+                    {
+                        operand[i] &= ~(1 << bit);
+                    }
+                    break;
+                case 3: //SET
+                    for (int i=0; i<LANES; ++i)
+                    {
+                        operand[i] |= 1 << bit;
+                    }
+                    break;
+            }
+
+            if (reg == REG_HL && (d8 >> 6) != 1)
+            {
+                write_lanes(addresses, registers[REG_HL]);
+            }
+            break;
+        }
+
+        default:
+            return 0;
+    }
+
+    pc = next_pc;
+    if (size > 1)
+    {
+        arg1 = bytes[1];
+    }
+    if (size > 2)
+    {
+        arg2 = bytes[2];
+    }
+
+    return ticks;
+}
+
+template class LockstepEngine<8>;
+template class LockstepEngine<16>;
+
+template<int LANES>
+static int run_benchmark(const HeadlessOptions &options)
+{
+    const std::uint64_t ticks = options.frames * TICKS_PER_FRAME;
+
+    //Every instance holds a different button combination
+    auto give_inputs = [](System &system, int lane)
+    {
+        set_joypad_input(system.bus.p1_joypad, lane);
+    };
+
+    auto state_hash = [](System &system)
+    {
+        SaveState state;
+        state.begin_save();
+        system.serialize(state);
+        return state.hash();
+    };
+
+    std::vector<std::unique_ptr<System>> scalar_systems;
+    for (int i=0; i<LANES; ++i)
+    {
+        scalar_systems.push_back(std::make_unique<System>(options.rom_file, false, options.patch_file));
+        scalar_systems.back()->cpu.trace_instructions = false;
+        give_inputs(*scalar_systems.back(), i);
+    }
+
+    std::uint64_t scalar_instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto &system : scalar_systems)
+    {
+        for (std::uint64_t clock = 0; clock < ticks; ++scalar_instructions)
+        {
+            clock += system->tick();
+        }
+    }
+    const std::chrono::duration<double> scalar_time = std::chrono::steady_clock::now() - start;
+
+    LockstepEngine<LANES> engine(options.rom_file, options.patch_file);
+    for (int i=0; i<LANES; ++i)
+    {
+        give_inputs(engine.lane(i), i);
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (std::uint64_t frame = 0; frame < options.frames; ++frame)
+    {
+        engine.run(TICKS_PER_FRAME);
+    }
+    const std::chrono::duration<double> lockstep_time = std::chrono::steady_clock::now() - start;
+
+    int matching = 0;
+    for (int i=0; i<LANES; ++i)
+    {
+        matching += state_hash(engine.lane(i)) == state_hash(*scalar_systems[i]);
+    }
+
+    const auto lockstep_instructions = engine.vector_instructions + engine.scalar_instructions;
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Instances          : " << LANES << "\n"
+              << "Frames             : " << options.frames << "\n"
+              << "Scalar             : " << scalar_instructions / scalar_time.count() / 1e6 << " M instructions/s\n"
+              << "Lockstep           : " << lockstep_instructions / lockstep_time.count() / 1e6 << " M instructions/s\n"
+              << "Speedup            : " << scalar_time.count() / lockstep_time.count() << "x\n"
+              << "Vector instructions: " << 100.0 * engine.vector_instructions / lockstep_instructions << "%\n"
+              << "Still in lockstep  : " << __builtin_popcount(engine.group) << "\n"
+              << "Matching states    : " << matching << "/" << LANES << std::endl;
+
+    return matching == LANES ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int run_lockstep_benchmark(const HeadlessOptions &options)
+{
+    switch (options.lockstep_instances)
+    {
+        case 8: return run_benchmark<8>(options);
+        case 16: return run_benchmark<16>(options);
+    }
+    throw std::runtime_error("Lockstep runs 8 or 16 instances");
+}
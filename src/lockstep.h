@@ -0,0 +1,82 @@
+#pragma once
+
+#include "system.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct HeadlessOptions;
+
+// Runs LANES instances of the same ROM side by side. While the instances sit
+// at the same PC on the same cycle, their CPU registers live here in
+// structure-of-arrays form and one decoded instruction is executed for all of
+// them at once. An instance that branches differently, takes an interrupt or
+// hits an instruction without a lane implementation is stepped through its
+// own Cpu for that instruction; if it ends up somewhere else than the rest of
+// the group it leaves the group until it meets it again on an interrupt.
+//
+// Memory stays in each instance's Bus, so I/O behaves exactly as in a
+// scalar System and the instances' states match separate Systems fed the
+// same inputs.
+template<int LANES>
+class LockstepEngine
+{
+public:
+    explicit LockstepEngine(const std::string &rom_file, const std::string &patch_file = "");
+
+    // Advances every instance by (at least) the given number of ticks.
+    // The Systems are up to date again when this returns.
+    void run(std::uint64_t ticks);
+
+    System &lane(int i) { return *systems[i]; }
+
+    // Instructions executed per instance, summed over all instances
+    std::uint64_t vector_instructions = 0;
+    std::uint64_t scalar_instructions = 0;
+
+    // Instances currently executing together
+    std::uint32_t group = (1u << LANES) - 1;
+
+private:
+    std::vector<std::unique_ptr<System>> systems;
+    std::uint64_t clocks[LANES] = {0};
+    std::uint64_t target = 0;
+    bool scalar_next = false;
+
+    // B C D E H L (HL) A, in the order the opcodes encode them.
+    // Row 6 holds the memory operand of (HL) instructions.
+    alignas(32) std::uint8_t registers[8][LANES];
+    alignas(32) std::uint8_t f[LANES];
+    alignas(32) std::uint16_t sp[LANES];
+    std::uint16_t pc = 0;
+    std::uint8_t arg1 = 0;
+    std::uint8_t arg2 = 0;
+
+    int leader() const { return __builtin_ctz(group); }
+
+    void load_group();
+    void store_group();
+    bool needs_scalar() const;
+    void step_scalar();
+    void catch_up(int i, std::uint64_t until);
+
+    std::size_t step_vector();
+
+    void read_lanes(const std::uint16_t *addresses, std::uint8_t *values);
+    void write_lanes(const std::uint16_t *addresses, const std::uint8_t *values);
+    void hl_addresses(std::uint16_t *addresses, int step);
+    bool condition(int code, bool &taken) const;
+
+    void alu(int operation, const std::uint8_t *values);
+    void inc_dec(std::uint8_t *values, bool decrement);
+    void rotate_shift(int operation, std::uint8_t *values);
+};
+
+extern template class LockstepEngine<8>;
+extern template class LockstepEngine<16>;
+
+// Runs --lockstep N copies of the ROM with different inputs, once through
+// LockstepEngine and once as N separate Systems, and compares the two
+int run_lockstep_benchmark(const HeadlessOptions &options);
@@ -1,9 +1,16 @@
 #include <iostream>
 #include <iomanip>
 #include <memory>
+#include <chrono>
 
 //---------------
 #include "system.h"
+#include "headless.h"
+#include "test_roms.h"
+#include "rom_library.h"
+#include "recompiler.h"
+#include "link_cable.h"
+#include "debug_views.h"
 
 //----------------
 #if __GNUC__ < 8
@@ -22,15 +29,53 @@ class GesserBoy : public olc::PixelGameEngine
 
     int mode = 0;
 
+    // Fast-forward: 0 runs as many frames as fit in a host frame, N runs at N times normal speed
+    bool turbo = false;
+    int turbo_multiplier = 0;
+    float turbo_speed = 0.0f;
+
     System system;
+    std::unique_ptr<SocketLink> link;
+    // The PPU writes its lines straight into this
+    olc::Sprite screen_area{ 160, 144 };
+
+    // Debugger views, redrawn a few times a second where VRAM, OAM or palettes changed
+    static constexpr float DEBUG_VIEW_INTERVAL = 0.1f;
+    float debug_view_time = DEBUG_VIEW_INTERVAL;
+    olc::Sprite tileset_area{ PpuDebugViews::TILESET_WIDTH, PpuDebugViews::TILESET_HEIGHT };
+    olc::Sprite tile_map_area{ PpuDebugViews::MAP_SIZE, PpuDebugViews::MAP_SIZE };
+    olc::Sprite objects_area{ PpuDebugViews::OBJECTS_WIDTH, PpuDebugViews::OBJECTS_HEIGHT };
+    olc::Sprite object_layer_area{ PpuDebugViews::OBJECT_LAYER_SIZE, PpuDebugViews::OBJECT_LAYER_SIZE };
+    std::unique_ptr<PpuDebugViews> debug_views;
 
     std::vector<std::pair<std::string,std::string>> log;
 
 public:
-    GesserBoy(const std::string &rom_file)
-        : system(rom_file)
+    GesserBoy(const HeadlessOptions &options)
+        : turbo_multiplier(options.turbo_multiplier)
+        , system(options.rom_file, true, options.patch_file)
+        , link(open_socket_link(options))
     {
         sAppName = "GesserBoy";
+        system.serial.link = link.get();
+        system.cart.mbc->set_real_time( ! options.deterministic_rtc);
+
+        Ppu::OutputSurface surface;
+        surface.pixels = screen_area.GetData();
+        surface.pitch = screen_area.width * sizeof(olc::Pixel);
+        for (int shade = 0; shade < 4; ++shade)
+        {
+            surface.palette[shade] = color(shade).n;
+        }
+        system.ppu.set_output_surface(surface);
+        system.ppu.set_threaded_rendering(options.threaded_rendering);
+        system.ppu.set_deferred_rendering(options.deferred_rendering);
+
+        debug_views = std::make_unique<PpuDebugViews>(surface.palette,
+                                                      &tileset_area.GetData()->n,
+                                                      &tile_map_area.GetData()->n,
+                                                      &objects_area.GetData()->n,
+                                                      &object_layer_area.GetData()->n);
     }
 
 public:
@@ -50,6 +95,20 @@ public:
         }
 
         s_accumulated_time += elapsed_time;
+
+        if (turbo && running)
+        {
+            turbo_step(elapsed_time);
+            s_accumulated_time = 0.0f;
+
+            Clear(olc::BLACK);
+            draw_screen(0, 9*7, 2);
+            std::ostringstream speed;
+            speed << "TURBO x" << std::fixed << std::setprecision(1) << turbo_speed;
+            DrawString(0, 0, speed.str(), olc::RED);
+            return true;
+        }
+
         if (s_accumulated_time < target_frame_time)
         {
             return true;
@@ -83,6 +142,13 @@ public:
 
         frame_stepping = scanline_stepping = stepping = false;
 
+        debug_view_time += elapsed_time;
+        if (mode != 0 && debug_view_time >= DEBUG_VIEW_INTERVAL)
+        {
+            debug_views->refresh(system.ppu);
+            debug_view_time = 0.0f;
+        }
+
         Clear(olc::BLACK);
         {
             draw_debug_info(0, 0);
@@ -92,6 +158,7 @@ public:
             {
                 draw_screen(0, 9*7, 1);
                 draw_tileset(164, 9*7);
+                DrawSprite(0, 9*7 + 148, &objects_area);
             }
             else if (mode == 2)
             {
@@ -132,6 +199,11 @@ public:
             running = false;
         }
 
+        if (GetKey(olc::Key::TAB).bPressed)
+        {
+            turbo = ! turbo;
+        }
+
         if (GetKey(olc::Key::M).bPressed)
         {
             mode = (mode+1) % 3;
@@ -197,10 +269,87 @@ public:
         {
             step();
         }
-        system.ppu.frame_ready = false;
+        if (system.ppu.frame_ready)
+        {
+            system.ppu.frame_ready = false;
+            //Polls count emulated frames, not host ones
+            system.cart.poll_battery();
+        }
+    }
+
+    //Runs frames without the per-instruction log, drawing pixels only for the last one
+    void turbo_step(float elapsed_time)
+    {
+        using clock = std::chrono::steady_clock;
+        static const auto time_budget = std::chrono::milliseconds(15);
+        static const float frame_rate = 59.7275f;
+        static float s_turbo_time = 0.0f;
+
+        const auto start = clock::now();
+        auto frame_time = clock::duration::zero();
+
+        int frames_due = 0;
+        if (turbo_multiplier > 0)
+        {
+            s_turbo_time += elapsed_time;
+            frames_due = int(s_turbo_time * frame_rate * turbo_multiplier);
+            s_turbo_time -= frames_due / (frame_rate * turbo_multiplier);
+        }
+
+        system.cpu.trace_instructions = false;
+
+        system.ppu.render_interval = 0;
+
+        int frames = 0;
+        for (bool last = false; running && ! last; ++frames)
+        {
+            last = turbo_multiplier > 0
+                 ? frames + 1 >= frames_due
+                 : clock::now() - start + 2 * frame_time >= time_budget;
+
+            if (turbo_multiplier > 0 && frames_due == 0)
+            {
+                break;
+            }
+
+            const auto frame_start = clock::now();
+            if (last)
+            {
+                system.ppu.request_frame();
+            }
+            fast_frame_step();
+            frame_time = clock::now() - frame_start;
+        }
+
+        system.ppu.render_interval = 1;
+        system.cpu.trace_instructions = true;
+
+        const float speed = elapsed_time > 0.0f ? frames / (elapsed_time * frame_rate) : 0.0f;
+        turbo_speed = 0.9f * turbo_speed + 0.1f * speed;
+    }
+
+    void fast_frame_step()
+    {
+        try
+        {
+            while ( ! system.ppu.frame_ready )
+            {
+                system.tick();
+            }
+        }
+        catch (std::exception const &e)
+        {
+            std::cerr << system.cpu.state_str() << " | " << e.what() << std::endl;
+            running = false;
+        }
+        if (system.ppu.frame_ready)
+        {
+            system.ppu.frame_ready = false;
+            system.cart.poll_battery();
+        }
     }
 
-    auto color(int plt_color)
+    olc::Pixel color(int plt_color)
     {
         return plt_color == 3 ? olc::BLACK
              : plt_color == 2 ? olc::VERY_DARK_GREY
@@ -211,13 +360,6 @@ public:
 
     void draw_screen(int x_start, int y_start, int scale)
     {
-        static olc::Sprite screen_area(160, 144);
-        olc::Pixel *buffer = screen_area.GetData();
-        auto ppu_buffer = system.ppu.screen_buffer;
-        for (int i=0; i<160*144; ++i)
-        {
-            buffer[i] = color(ppu_buffer[i]);
-        }
         DrawSprite(x_start, y_start, &screen_area, scale);
     }
 
@@ -261,66 +403,129 @@ public:
 
     void draw_tileset(int x_start, int y_start)
     {
-        for (int t=0; t<384; ++t)
-        {
-
-            for (int y=0; y<8; ++y)
-            {
-                for (int x=0; x<8; ++x)
-                {
-                    auto pix = system.ppu.tile_pixel_value(t, x, y, 0);
-
-                    auto color = pix == 1 ? olc::VERY_DARK_GREY
-                               : pix == 2 ? olc::DARK_GREY
-                               : pix == 3 ? olc::BLACK
-                                          : olc::GREY;
-                    Draw(x_start + x + t * 8 % 160,
-                         y_start + y + t * 8 / 160 * 8, color);
-                }
-            }
-        }
+        DrawSprite(x_start, y_start, &tileset_area);
     }
 
+    // The background map scrolled so the visible part is at the top left, objects on top
     void draw_tile_map(int x_start, int y_start)
     {
-        static olc::Sprite screen_area(256, 256);
-
-        auto raw_map = system.ppu.render_tiles_map();
+        //Scrolled as of the last refresh, like the map and objects themselves
+        const int sx = debug_views->scroll_x;
+        const int sy = debug_views->scroll_y;
+        const int size = PpuDebugViews::MAP_SIZE;
+
+        DrawPartialSprite(x_start,           y_start,           &tile_map_area, sx, sy, size - sx, size - sy);
+        DrawPartialSprite(x_start + size-sx, y_start,           &tile_map_area, 0,  sy, sx,        size - sy);
+        DrawPartialSprite(x_start,           y_start + size-sy, &tile_map_area, sx, 0,  size - sx, sy);
+        DrawPartialSprite(x_start + size-sx, y_start + size-sy, &tile_map_area, 0,  0,  sx,        sy);
+
+        //Transparent where the layer is 0
+        SetPixelMode(olc::Pixel::MASK);
+        DrawSprite(x_start, y_start, &object_layer_area);
+        SetPixelMode(olc::Pixel::NORMAL);
+
+        DrawRect(x_start, y_start, 159, 143, olc::RED);
+    };
+};
 
-        olc::Pixel *buffer = screen_area.GetData();
+int main(int argc, char**argv)
+{
+    bool headless = false;
+    HeadlessOptions options;
+    TestRomOptions test_options;
+    RomLibraryOptions library_options;
+    std::string recompile_output;
 
-        for (int i=0; i<256*256; ++i)
-        {
-            buffer[i] = color(raw_map[i]);
-        }
+    for (int i=1; i<argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool has_value = i+1 < argc;
+
+        if (arg == "--headless") headless = true;
+        else if (arg == "--frames" && has_value) options.frames = std::stoull(argv[++i]);
+        else if (arg == "--audio" && has_value) options.audio_file = argv[++i];
+        else if (arg == "--audio-hash" && has_value) options.audio_hash_file = argv[++i];
+        else if (arg == "--test-roms" && has_value) test_options.directory = argv[++i];
+        else if (arg == "--timeout-cycles" && has_value) test_options.timeout_ticks = std::stoull(argv[++i]);
+        else if (arg == "--jobs" && has_value) test_options.jobs = library_options.jobs = std::stoul(argv[++i]);
+        else if (arg == "--library" && has_value) library_options.directory = argv[++i];
+        else if (arg == "--library-index" && has_value) library_options.index_file = argv[++i];
+        else if (arg == "--find" && has_value) library_options.query = argv[++i];
+        else if (arg == "--deterministic-rtc") options.deterministic_rtc = true;
+        else if (arg == "--turbo" && has_value) options.turbo_multiplier = std::stoi(argv[++i]);
+        else if (arg == "--netplay" && i+2 < argc) { options.netplay_port = std::stoi(argv[++i]); options.netplay_peer_port = std::stoi(argv[++i]); }
+        else if (arg == "--player" && has_value) options.netplay_player = std::stoi(argv[++i]);
+        else if (arg == "--link-rom" && has_value) options.link_rom_file = argv[++i];
+        else if (arg == "--link-listen" && has_value) options.link_listen = argv[++i];
+        else if (arg == "--link-connect" && has_value) options.link_connect = argv[++i];
+        else if (arg == "--recompile" && has_value) recompile_output = argv[++i];
+        else if (arg == "--lockstep" && has_value) options.lockstep_instances = std::stoi(argv[++i]);
+        else if (arg == "--snapshot-cache" && has_value) options.snapshot_cache = argv[++i];
+        else if (arg == "--warm-frames" && has_value) options.warm_frames = std::stoull(argv[++i]);
+        else if (arg == "--patch" && has_value) options.patch_file = argv[++i];
+        else if (arg == "--render-every" && has_value) options.render_interval = std::stoi(argv[++i]);
+        else if (arg == "--threaded-render") options.threaded_rendering = true;
+        else if (arg == "--deferred-render") options.deferred_rendering = true;
+        else options.rom_file = arg;
+    }
 
-        for (int x=0; x<160; ++x)
-        {
-            screen_area.SetPixel((x+system.ppu.lcd_scroll_x/8)%256, (system.ppu.lcd_scroll_y/8)%256, olc::RED);
-            screen_area.SetPixel((x+system.ppu.lcd_scroll_x/8)%256, (system.ppu.lcd_scroll_y/8+144)%256, olc::RED);
-        }
+    if ( ! test_options.directory.empty())
+    {
+        return run_test_roms(test_options);
+    }
 
-        for (int y=0; y<144; ++y)
-        {
-            screen_area.SetPixel((system.ppu.lcd_scroll_x/8)%256,     (y+system.ppu.lcd_scroll_y/8)%256, olc::RED);
-            screen_area.SetPixel((system.ppu.lcd_scroll_x/8+160)%256, (y+system.ppu.lcd_scroll_y/8)%256, olc::RED);
-        }
+    if ( ! library_options.directory.empty())
+    {
+        return run_rom_library(library_options);
+    }
 
-        DrawSprite(x_start, y_start, &screen_area);
-    };
-};
+    //Compressed ROMs the index has already inflated load from its copy
+    if ( ! library_options.index_file.empty() && ! options.rom_file.empty())
+    {
+        options.rom_file = RomLibrary(library_options.index_file).resolve(options.rom_file);
+    }
 
-int main(int argc, char**argv)
-{
-    if (argc < 2)
+    if (options.rom_file.empty())
     {
-        std::cout << "Usage: " << argv[0] << " ROM-File" << std::endl;
+        std::cout << "Usage: " << argv[0] << " [options] ROM-File\n"
+                  << "       " << argv[0] << " --test-roms DIR [--timeout-cycles N] [--jobs N]\n"
+                  << "       " << argv[0] << " --library DIR [--find TEXT] [--library-index FILE] [--jobs N]\n"
+                  << "       " << argv[0] << " --library-index FILE [options] ROM-File\n"
+                  << "  --headless           Run without a window\n"
+                  << "  --patch FILE         Apply an IPS or BPS patch to the ROM\n"
+                  << "  --frames N           Frames to run headless (default 3600)\n"
+                  << "  --audio FILE         Dump audio to FILE (.wav, otherwise raw s16le stereo 44100 Hz)\n"
+                  << "  --audio-hash FILE    Write a hash per emulated second of audio (- for stdout)\n"
+                  << "  --turbo N            Fast-forward (TAB) speed multiplier, 0 for as fast as possible\n"
+                  << "  --deterministic-rtc  Run the cartridge clock on emulated time (always the case headless)\n"
+                  << "  --link-rom ROM       Headless: link a second instance running ROM\n"
+                  << "  --link-listen PATH   Wait for a link cable connection on Unix socket PATH\n"
+                  << "  --link-connect PATH  Connect the link cable to Unix socket PATH\n"
+                  << "  --netplay PORT PEER  Headless: rollback netplay of the --link-rom pair over UDP loopback\n"
+                  << "  --player N           Netplay: which of the pair (0 or 1) this side controls\n"
+                  << "  --lockstep N         Headless: benchmark N (8 or 16) instances in lockstep against separate ones\n"
+                  << "  --snapshot-cache DIR Headless: start from a snapshot cached in DIR, storing it on the first run\n"
+                  << "  --warm-frames N      Frame the cached snapshot is taken at (default 60)\n"
+                  << "  --render-every N     Headless: draw pixels for every Nth frame only, 0 for none\n"
+                  << "  --threaded-render    Draw lines on a worker thread replaying the emulation's writes\n"
+                  << "  --deferred-render    Draw each frame's lines all at once at VBlank\n"
+                  << "  --recompile FILE     Translate the ROM to C++ in FILE, rebuild with it in recompiled/ to use it" << std::endl;
         return EXIT_SUCCESS;
     }
 
     try
     {
-        GesserBoy emulator(argv[1]);
+        if ( ! recompile_output.empty())
+        {
+            return recompile_rom(options.rom_file, recompile_output);
+        }
+
+        if (headless)
+        {
+            return run_headless(options);
+        }
+
+        GesserBoy emulator(options);
         if (emulator.Construct(330, 352, 2, 2))
             emulator.Start();
     }
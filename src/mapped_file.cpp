@@ -0,0 +1,95 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+MappedFile::MappedFile(const std::string &filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("Unable to stat file: " + filename);
+    }
+    length = info.st_size;
+
+    //An empty file can't be mapped, it simply has no data
+    if (length > 0)
+    {
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Unable to map file: " + filename);
+        }
+        address = static_cast<std::uint8_t *>(mapping);
+    }
+
+    //The mapping keeps the file alive
+    close(fd);
+}
+
+MappedFile::MappedFile(const std::string &filename, std::size_t size)
+{
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        close(fd);
+        throw std::runtime_error("Unable to stat file: " + filename);
+    }
+    length = size;
+
+    if (length > 0)
+    {
+        //Whole pages past the end of a file fault, so those come from anonymous memory underneath
+        void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        const std::size_t file_part = std::min<std::size_t>(length, info.st_size);
+        if (mapping != MAP_FAILED && file_part > 0
+            && mmap(mapping, file_part, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(mapping, length);
+            mapping = MAP_FAILED;
+        }
+        if (mapping == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Unable to map file: " + filename);
+        }
+        address = static_cast<std::uint8_t *>(mapping);
+    }
+
+    close(fd);
+}
+
+void MappedFile::make_read_only()
+{
+    if (address)
+    {
+        mprotect(address, length, PROT_READ);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (address)
+    {
+        munmap(address, length);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only private mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &filename);
+    // Writable copy-on-write mapping of size bytes: pages stay shared with the page cache until
+    // they are written, bytes past the end of the file read as zero
+    MappedFile(const std::string &filename, std::size_t size);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const std::uint8_t *data() const { return address; }
+    std::size_t size() const { return length; }
+
+    /// Only for copy-on-write mappings, until make_read_only()
+    std::uint8_t *writable_data() { return address; }
+    void make_read_only();
+
+private:
+    std::uint8_t *address = nullptr;
+    std::size_t length = 0;
+};
@@ -0,0 +1,257 @@
+#include "netplay.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const std::size_t MAX_INPUTS_PER_PACKET = 255;
+
+//Packet: u32 next frame wanted from the peer, u32 first frame, u8 count, inputs
+static const std::size_t PACKET_HEADER = 9;
+
+static sockaddr_in loopback_address(int port)
+{
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+NetplayTransport::NetplayTransport(int local_port, int remote_port)
+{
+    auto local = loopback_address(local_port);
+    auto remote = loopback_address(remote_port);
+
+    fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0
+        || ::bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) < 0
+        || ::connect(fd, reinterpret_cast<sockaddr*>(&remote), sizeof(remote)) < 0)
+    {
+        throw std::runtime_error("Unable to open netplay port " + std::to_string(local_port) + ": " + std::strerror(errno));
+    }
+}
+
+NetplayTransport::~NetplayTransport()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+void NetplayTransport::send_input(std::uint32_t frame, std::uint8_t input)
+{
+    if (frame != first_unacked + unacked.size())
+    {
+        throw std::logic_error("Netplay inputs must be sent in frame order");
+    }
+
+    unacked.push_back(input);
+    resend();
+}
+
+void NetplayTransport::resend()
+{
+    std::uint8_t packet[PACKET_HEADER + MAX_INPUTS_PER_PACKET];
+
+    const std::uint8_t count = std::min(unacked.size(), MAX_INPUTS_PER_PACKET);
+    std::memcpy(packet + 0, &next_remote, 4);
+    std::memcpy(packet + 4, &first_unacked, 4);
+    packet[8] = count;
+    std::copy_n(unacked.begin(), count, packet + PACKET_HEADER);
+
+    //Fails with ECONNREFUSED until the peer is up, the next send covers it
+    ::send(fd, packet, PACKET_HEADER + count, 0);
+}
+
+bool NetplayTransport::receive(const std::function<void(std::uint32_t, std::uint8_t)> &on_input, int timeout_ms)
+{
+    pollfd request { fd, POLLIN, 0 };
+    if (::poll(&request, 1, timeout_ms) <= 0)
+    {
+        return false;
+    }
+
+    bool received = false;
+    std::uint8_t packet[PACKET_HEADER + MAX_INPUTS_PER_PACKET];
+
+    while (true)
+    {
+        auto size = ::recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+        if (size < 0 && errno == ECONNREFUSED)
+        {
+            continue;
+        }
+        if (size < std::int64_t(PACKET_HEADER) || size < std::int64_t(PACKET_HEADER + packet[8]))
+        {
+            return received;
+        }
+        received = true;
+
+        std::uint32_t acknowledged;
+        std::uint32_t first_frame;
+        std::memcpy(&acknowledged, packet + 0, 4);
+        std::memcpy(&first_frame, packet + 4, 4);
+
+        while (first_unacked < acknowledged && ! unacked.empty())
+        {
+            unacked.pop_front();
+            ++first_unacked;
+        }
+
+        for (std::uint32_t i=0; i<packet[8]; ++i)
+        {
+            if (first_frame + i == next_remote)
+            {
+                on_input(next_remote++, packet[PACKET_HEADER + i]);
+            }
+        }
+    }
+}
+
+RollbackSession::RollbackSession(System &first, System &second, int local_player, NetplayTransport &transport)
+    : systems{ &first, &second }
+    , cable(first, second)
+    , local_player(local_player)
+    , transport(transport)
+    , start_time(std::chrono::steady_clock::now())
+{
+}
+
+void RollbackSession::receive_inputs(int timeout_ms)
+{
+    transport.receive([&](std::uint32_t frame, std::uint8_t input)
+    {
+        remote_inputs[frame % INPUT_HISTORY] = input;
+        last_remote_input = input;
+        confirmed_remote_frames = frame + 1;
+
+        if (frame < current_frame && used_remote_inputs[frame % INPUT_HISTORY] != input)
+        {
+            first_misprediction = std::min<std::uint64_t>(first_misprediction, frame);
+        }
+    }, timeout_ms);
+}
+
+void RollbackSession::advance_frame(std::uint8_t local_input)
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    local_inputs[current_frame % INPUT_HISTORY] = local_input;
+    transport.send_input(current_frame, local_input);
+
+    receive_inputs(0);
+
+    //Only stall when the peer is further behind than a rollback can reach
+    while (current_frame >= confirmed_remote_frames + MAX_ROLLBACK)
+    {
+        transport.resend();
+        receive_inputs(5);
+    }
+
+    rollback();
+    run_frame(current_frame);
+    ++current_frame;
+    ++metrics.frames;
+
+    const std::chrono::duration<double> frame_time = std::chrono::steady_clock::now() - start;
+    metrics.worst_frame_time = std::max(metrics.worst_frame_time, frame_time.count());
+}
+
+void RollbackSession::synchronize()
+{
+    while (confirmed_remote_frames < current_frame)
+    {
+        transport.resend();
+        receive_inputs(5);
+    }
+    rollback();
+
+    //Keep our inputs coming until the peer has all of them
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while ( ! transport.all_acknowledged() && std::chrono::steady_clock::now() < deadline)
+    {
+        transport.resend();
+        receive_inputs(5);
+    }
+}
+
+void RollbackSession::rollback()
+{
+    if (first_misprediction >= current_frame)
+    {
+        first_misprediction = UINT64_MAX;
+        return;
+    }
+
+    const auto from = first_misprediction;
+    first_misprediction = UINT64_MAX;
+
+    auto &state = states[from % HISTORY];
+    state.begin_load();
+    cable.serialize(state);
+
+    for (auto frame = from; frame < current_frame; ++frame)
+    {
+        run_frame(frame);
+    }
+
+    const int depth = current_frame - from;
+    ++metrics.rollbacks;
+    metrics.resimulated_frames += depth;
+    metrics.last_rollback_depth = depth;
+    metrics.max_rollback_depth = std::max(metrics.max_rollback_depth, depth);
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    metrics.resimulated_frames_per_second = metrics.resimulated_frames / elapsed.count();
+}
+
+void RollbackSession::run_frame(std::uint64_t frame)
+{
+    auto &state = states[frame % HISTORY];
+    state.begin_save();
+    cable.serialize(state);
+
+    const auto remote_input = frame < confirmed_remote_frames
+            ? remote_inputs[frame % INPUT_HISTORY]
+            : last_remote_input;
+    used_remote_inputs[frame % INPUT_HISTORY] = remote_input;
+
+    set_joypad_input(systems[local_player]->bus.p1_joypad, local_inputs[frame % INPUT_HISTORY]);
+    set_joypad_input(systems[1 - local_player]->bus.p1_joypad, remote_input);
+
+    cable.run(TICKS_PER_FRAME);
+}
+
+std::uint8_t joypad_input(const Bus::JoypadState &joypad)
+{
+    return (joypad.right  ? 0x01 : 0)
+         | (joypad.left   ? 0x02 : 0)
+         | (joypad.up     ? 0x04 : 0)
+         | (joypad.down   ? 0x08 : 0)
+         | (joypad.a      ? 0x10 : 0)
+         | (joypad.b      ? 0x20 : 0)
+         | (joypad.select ? 0x40 : 0)
+         | (joypad.start  ? 0x80 : 0);
+}
+
+void set_joypad_input(Bus::JoypadState &joypad, std::uint8_t input)
+{
+    joypad.right  = input & 0x01;
+    joypad.left   = input & 0x02;
+    joypad.up     = input & 0x04;
+    joypad.down   = input & 0x08;
+    joypad.a      = input & 0x10;
+    joypad.b      = input & 0x20;
+    joypad.select = input & 0x40;
+    joypad.start  = input & 0x80;
+}
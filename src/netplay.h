@@ -0,0 +1,97 @@
+#pragma once
+
+#include "link_cable.h"
+#include "save_state.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+// Exchanges joypad inputs with the other player over UDP on the loopback interface.
+// Every packet repeats all inputs the peer hasn't acknowledged yet, so lost
+// datagrams are covered by the next one.
+class NetplayTransport
+{
+public:
+    NetplayTransport(int local_port, int remote_port);
+    ~NetplayTransport();
+
+    // Inputs must be sent for consecutive frames
+    void send_input(std::uint32_t frame, std::uint8_t input);
+    void resend();
+    bool all_acknowledged() const { return unacked.empty(); }
+
+    // Calls on_input for every newly received remote input, in frame order.
+    // Returns false if nothing arrived within timeout_ms.
+    bool receive(const std::function<void(std::uint32_t, std::uint8_t)> &on_input, int timeout_ms);
+
+private:
+    int fd = -1;
+
+    std::deque<std::uint8_t> unacked;
+    std::uint32_t first_unacked = 0;
+    std::uint32_t next_remote = 0;
+};
+
+struct RollbackMetrics
+{
+    std::uint64_t frames = 0;
+    std::uint64_t rollbacks = 0;
+    std::uint64_t resimulated_frames = 0;
+    int last_rollback_depth = 0;
+    int max_rollback_depth = 0;
+    double resimulated_frames_per_second = 0;
+    double worst_frame_time = 0;
+};
+
+// Runs a linked pair of systems on both players' machines. The remote player's
+// input is predicted to repeat, and when the real one differs the pair is
+// restored from the snapshot of that frame and simulated forward again.
+class RollbackSession
+{
+public:
+    static const int MAX_ROLLBACK = 12;
+    static const std::uint64_t TICKS_PER_FRAME = 70224;
+
+    RollbackSession(System &first, System &second, int local_player, NetplayTransport &transport);
+
+    void advance_frame(std::uint8_t local_input);
+    // Waits for every remote input up to the current frame and corrects the state
+    void synchronize();
+
+    std::uint64_t frame() const { return current_frame; }
+
+    RollbackMetrics metrics;
+
+private:
+    // Snapshots cover the frames a rollback can reach, inputs also the frames
+    // the peer may already be ahead of us
+    static const int HISTORY = MAX_ROLLBACK + 1;
+    static const int INPUT_HISTORY = 4 * MAX_ROLLBACK;
+
+    void receive_inputs(int timeout_ms);
+    void rollback();
+    void run_frame(std::uint64_t frame);
+
+    System *systems[2];
+    LinkCable cable;
+    int local_player;
+    NetplayTransport &transport;
+
+    std::uint64_t current_frame = 0;
+    std::uint64_t confirmed_remote_frames = 0;
+    std::uint64_t first_misprediction = UINT64_MAX;
+
+    std::uint8_t local_inputs[INPUT_HISTORY] = {0};
+    std::uint8_t remote_inputs[INPUT_HISTORY] = {0};
+    std::uint8_t used_remote_inputs[INPUT_HISTORY] = {0};
+    std::uint8_t last_remote_input = 0;
+    SaveState states[HISTORY];
+
+    std::chrono::steady_clock::time_point start_time;
+};
+
+// Joypad state as a bit mask: right, left, up, down, a, b, select, start
+std::uint8_t joypad_input(const Bus::JoypadState &joypad);
+void set_joypad_input(Bus::JoypadState &joypad, std::uint8_t input);
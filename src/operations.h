@@ -317,6 +317,14 @@ struct HALT : Operation<1> {
     static void print(std::ostream &out, const Cpu &) { out << "HALT"; }
 };
 
+/// LD B,B is a no-op that test ROMs use as a software breakpoint
+struct BREAKPOINT : Operation<1> {
+    using result_type = void;
+
+    static void execute(Cpu &cpu) { cpu.software_breakpoint = true; }
+    static void print(std::ostream &out, const Cpu &) { out << "LD B, B"; }
+};
+
 struct STOP : Operation<2> {
     using result_type = void;
 
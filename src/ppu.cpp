@@ -1,11 +1,21 @@
 #include "ppu.h"
 
 
+#include <algorithm>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include "bus.h"
+#include "save_state.h"
+#include "threaded_renderer.h"
+#include "deferred_renderer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 
 static const int LINES_PER_FRAME = 154;
@@ -17,7 +27,82 @@ static const int LCD_WIDTH = 160;
 
 Ppu::Ppu(Bus &bus) : bus(bus)
 {
+    invalidate_tiles();
+}
+
+Ppu::~Ppu() = default;
+
+void Ppu::set_threaded_rendering(bool enable)
+{
+    if (enable && ! renderer)
+    {
+        set_deferred_rendering(false);
+        renderer = std::make_unique<ThreadedRenderer>(*this);
+    }
+    else if ( ! enable && renderer)
+    {
+        //Takes back the frames and the surface the worker was drawing into
+        renderer->finish();
+        adopt_frames(renderer->shadow);
+        renderer.reset();
+    }
+}
+
+void Ppu::set_deferred_rendering(bool enable)
+{
+    if (enable && ! deferred)
+    {
+        set_threaded_rendering(false);
+        deferred = std::make_unique<DeferredRenderer>(*this);
+    }
+    else if ( ! enable && deferred)
+    {
+        deferred->flush();
+        adopt_frames(deferred->shadow);
+        deferred.reset();
+    }
+}
+
+void Ppu::adopt_frames(Ppu &other)
+{
+    std::memcpy(frame_buffers, other.frame_buffers, sizeof(frame_buffers));
+    back_index = other.back_index;
+    completed_frames = other.completed_frames;
+    output = other.output;
+}
 
+Ppu &Ppu::frame_owner()
+{
+    if (renderer)
+    {
+        return renderer->shadow;
+    }
+    return deferred ? deferred->shadow : *this;
+}
+
+void Ppu::log_vram_write(std::uint16_t offset, std::uint8_t value)
+{
+    if (renderer)
+    {
+        renderer->log(ThreadedRenderer::VRAM, offset, value);
+    }
+    else
+    {
+        deferred->record_write(0x8000 + offset, value);
+    }
+}
+
+void Ppu::log_write(std::uint16_t address, std::uint8_t value)
+{
+    if (renderer)
+    {
+        renderer->log(ThreadedRenderer::REGISTER, address, value);
+    }
+    //Registers are taken a line at a time instead
+    else if (deferred && address <= 0xFE9F)
+    {
+        deferred->record_write(address, value);
+    }
 }
 
 void emit_stat_interrupt(Ppu &ppu, bool condition)
@@ -48,6 +133,13 @@ void Ppu::run_ounce()
         }
     }
 
+    if (line_y == 0 && line_tick == 0)
+    {
+        const auto frames = rendered_frames + skipped_frames;
+        render_frame = frame_requested || (render_interval > 0 && frames % render_interval == 0);
+        frame_requested = false;
+    }
+
     lcd_status.lyc_eq_ly_flag = line_y == ly_compare;
 
     if (line_y == ly_compare)
@@ -67,6 +159,15 @@ void Ppu::run_ounce()
             {
                 lcd_status.current_mode = Ppu::OAM;
                 emit_stat_interrupt(*this, lcd_status.STAT_oam_interrupt_source);
+                scan_oam();
+                if (renderer && render_frame)
+                {
+                    renderer->log(ThreadedRenderer::SCAN_OAM);
+                }
+                else if (deferred && render_frame)
+                {
+                    deferred->record_scan();
+                }
             }
 
 
@@ -79,7 +180,19 @@ void Ppu::run_ounce()
             if (lcd_status.current_mode != Ppu::TRANSFER)
             {
                 lcd_status.current_mode = Ppu::TRANSFER;
-                render_current_scanline();
+                if (render_frame && renderer)
+                {
+                    renderer->log(ThreadedRenderer::RENDER_LINE);
+                }
+                else if (render_frame && deferred)
+                {
+                    deferred->record_line();
+                }
+                else if (render_frame)
+                {
+                    render_current_scanline();
+                    write_output_line();
+                }
             }
 
             //CPU cannot access OAM ($FE00-FE9F).
@@ -104,6 +217,22 @@ void Ppu::run_ounce()
         if (lcd_status.current_mode != Ppu::VBLANK)
         {
             frame_ready = true;
+            ++(render_frame ? rendered_frames : skipped_frames);
+            if (render_frame && renderer)
+            {
+                //Whoever sees frame_ready next finds the frame complete
+                renderer->log(ThreadedRenderer::END_FRAME);
+                renderer->finish();
+            }
+            else if (deferred)
+            {
+                //Skipped frames still bring the shadow's memory up to date
+                deferred->end_frame(render_frame);
+            }
+            else if (render_frame)
+            {
+                swap_frame_buffers();
+            }
 
             if (lcd_control.lcd_ppu_enable)
             {
@@ -161,11 +290,111 @@ int Ppu::tile_pixel_value(int tile_index, int x, int y, int tiles_offset)
     return pix;
 }
 
-void Ppu::render_current_scanline()
+void Ppu::swap_frame_buffers()
+{
+    //A reader holding the front buffer keeps it, this frame is then drawn over
+    std::unique_lock<std::mutex> lock(front_mutex, std::try_to_lock);
+    if (lock.owns_lock())
+    {
+        back_index ^= 1;
+        ++completed_frames;
+    }
+}
+
+Ppu::Frame Ppu::acquire_frame()
+{
+    if (&frame_owner() != this)
+    {
+        return frame_owner().acquire_frame();
+    }
+
+    std::unique_lock<std::mutex> lock(front_mutex);
+    const auto pixels = frame_buffers[back_index ^ 1];
+    return Frame{ std::move(lock), pixels, completed_frames };
+}
+
+template<typename Pixel>
+static void map_line(const std::uint8_t *shades, void *row, const std::uint32_t palette[4])
+{
+    const Pixel colors[4] = { Pixel(palette[0]), Pixel(palette[1]), Pixel(palette[2]), Pixel(palette[3]) };
+    auto pixels = static_cast<Pixel *>(row);
+    for (int x = 0; x < LCD_WIDTH; ++x)
+    {
+        pixels[x] = colors[shades[x]];
+    }
+}
+
+void Ppu::set_output_surface(const OutputSurface &surface)
+{
+    output = surface;
+    if (renderer)
+    {
+        //The worker may still be writing lines to the old one
+        renderer->finish();
+    }
+    frame_owner().output = surface;
+}
+
+void Ppu::write_output_line()
+{
+    if ( ! output.pixels)
+    {
+        return;
+    }
+
+    const auto shades = back_buffer() + line_y * LCD_WIDTH;
+    const auto row = static_cast<std::uint8_t *>(output.pixels) + line_y * output.pitch;
+    switch (output.format)
+    {
+        case OutputSurface::RGBA8888: map_line<std::uint32_t>(shades, row, output.palette); break;
+        case OutputSurface::RGB565:   map_line<std::uint16_t>(shades, row, output.palette); break;
+        case OutputSurface::INDEXED8: map_line<std::uint8_t>(shades, row, output.palette); break;
+    }
+}
+
+void Ppu::invalidate_tiles()
+{
+    for (auto &bits : dirty_tiles)
+    {
+        bits = ~std::uint64_t(0);
+    }
+}
+
+void Ppu::decode_dirty_tiles()
+{
+    for (int word = 0; word < TILE_COUNT / 64; ++word)
+    {
+        for (auto bits = dirty_tiles[word]; bits; bits &= bits - 1)
+        {
+            const int tile = word * 64 + __builtin_ctzll(bits);
+            const auto tile_start = video_ram + tile * 16;
+
+            for (int y = 0; y < 8; ++y)
+            {
+                const auto b0 = tile_start[2*y];
+                const auto b1 = tile_start[2*y+1];
+
+                for (int x = 0; x < 8; ++x)
+                {
+                    const auto pix = ((b0 >> (7-x)) & 1) | (((b1 >> (7-x)) & 1) << 1);
+                    decoded_tiles[0][tile][y][x] = pix;
+                    decoded_tiles[1][tile][y][7-x] = pix;
+                }
+            }
+            ++tile_versions[tile];
+        }
+        dirty_tiles[word] = 0;
+    }
+}
+
+void Ppu::render_scanline_reference()
 {
     std::uint8_t scanline[LCD_WIDTH] = {0};
+    auto screen_line = back_buffer() + line_y * LCD_WIDTH;
 
-    //Draw background
+    decode_dirty_tiles();
+
+    //Draw background, a tile row at a time
     if (lcd_control.bg_window_enable)
     {
         int map_offset = lcd_control.bg_tile_map_area == 0
@@ -177,23 +406,26 @@ void Ppu::render_current_scanline()
         auto tile_y = y_on_map / 8;
         auto y_in_tile = scrolled_y % 8;
 
-        for (int line_x=0; line_x < LCD_WIDTH; ++line_x)
+        int x_on_map = lcd_scroll_x;
+        for (int line_x=0; line_x < LCD_WIDTH; )
         {
-            auto scrolled_x = line_x + lcd_scroll_x;
-            auto x_on_map = scrolled_x % 256;
-            auto tile_x = x_on_map / 8;
-            auto x_in_tile = scrolled_x % 8;
-
-            auto tile_index = tile_index_on_map(map_offset, tile_x, tile_y);
-
-            auto pix = tile_pixel_value(tile_index, x_in_tile, y_in_tile, tiles_offset());
-            scanline[line_x] = pix;
+            auto tile_index = tile_index_on_map(map_offset, x_on_map / 8, tile_y);
+            auto row = tile_row(tile_number(tile_index, tiles_offset()), y_in_tile, false);
 
-            auto background_color = bg_palette_data[pix];
-
-            screen_buffer[line_x + line_y * LCD_WIDTH] = background_color;
+            for (int x_in_tile = x_on_map % 8; x_in_tile < 8 && line_x < LCD_WIDTH; ++x_in_tile, ++line_x)
+            {
+                auto pix = row[x_in_tile];
+                scanline[line_x] = pix;
+                screen_line[line_x] = bg_palette_data[pix];
+            }
+            x_on_map = (lcd_scroll_x + line_x) % 256;
         }
     }
+    else
+    {
+        //Shade 0 whatever the palette, objects still show
+        std::fill(screen_line, screen_line + LCD_WIDTH, 0);
+    }
 
     //Draw window
     if (lcd_control.bg_window_enable && lcd_control.window_enable)
@@ -208,70 +440,54 @@ void Ppu::render_current_scanline()
             auto tile_y = window_y / 8;
             auto y_in_tile = window_y % 8;
 
-            for (int line_x=0; line_x < LCD_WIDTH; ++line_x)
+            int line_x = std::max(0, 7 - window_x_pos);
+            int window_x = line_x + window_x_pos - 7;
+            while (line_x < LCD_WIDTH && window_x < LCD_WIDTH)
             {
-                auto window_x = int(line_x) + window_x_pos - 7;
+                auto tile_index = tile_index_on_map(map_offset, window_x / 8, tile_y);
+                auto row = tile_row(tile_number(tile_index, tiles_offset()), y_in_tile, false);
 
-                if (window_x < 0 || window_x >= LCD_WIDTH)
+                for (int x_in_tile = window_x % 8; x_in_tile < 8 && line_x < LCD_WIDTH; ++x_in_tile, ++line_x, ++window_x)
                 {
-                    continue;
+                    screen_line[line_x] = bg_palette_data[row[x_in_tile]];
                 }
-
-                auto tile_x = window_x / 8;
-                auto x_in_tile = window_x % 8;
-
-                auto tile_index = tile_index_on_map(map_offset, tile_x, tile_y);
-
-                auto pix = tile_pixel_value(tile_index, x_in_tile, y_in_tile, tiles_offset());
-                auto background_color = bg_palette_data[pix];
-
-                screen_buffer[line_x + line_y * LCD_WIDTH] = background_color;
             }
         }
     }
 
     if (lcd_control.obj_enable)
     {
-        const auto obj_height = lcd_control.big_obj ? 16 : 8;
+        //The first opaque object pixel in priority order wins, then decides whether the background covers it
+        bool taken[LCD_WIDTH] = {false};
 
-        for (int n = 39; n >= 0; --n)
+        for (int i = 0; i < line_object_count; ++i)
         {
-            auto s = n*4;
+            const auto &object = objects[line_objects[i]];
 
-            auto obj_y   = obj_attribute_memory[s+0] -16;
-            auto obj_x   = obj_attribute_memory[s+1] - 8;
-            auto obj_tile = obj_attribute_memory[s+2];
-            auto obj_attr = ObjAttribs{ obj_attribute_memory[s+3] };
-
-            if (obj_y > line_y || (obj_y + obj_height) <= line_y)
-            {
-                continue;
-            }
+            int y_in_tile = object.y_flip
+                    ? (line_object_height-1) - (line_y - object.y)
+                    : line_y - object.y;
 
-            int y_in_tile = obj_attr.y_flip
-                    ? (obj_height-1) - (line_y - obj_y)
-                    : line_y - obj_y;
+            //Already mirrored when x_flip is set
+            auto row = tile_row(object_tile(object), y_in_tile, object.x_flip);
 
             for (int x = 0; x < 8; x++)
             {
-                auto line_x = obj_x+x;
-                if (line_x< 0 || line_x >= LCD_WIDTH)
+                auto line_x = object.x+x;
+                if (line_x< 0 || line_x >= LCD_WIDTH || taken[line_x])
                 {
                     continue;
                 }
 
-                auto x_in_tile = obj_attr.x_flip
-                        ? 7-x
-                        : x;
-
-                auto pix = tile_pixel_value(obj_tile, x_in_tile, y_in_tile, 0);
+                auto pix = row[x];
                 if (pix > 0)
                 {
-                    auto color = obj_palette_data[obj_attr.pallete_number][pix];
+                    taken[line_x] = true;
+                    auto color = obj_palette_data[object.palette][pix];
 
-                    if ( ! obj_attr.bg_window_over || scanline[line_x] == 0)
+                    if ( ! object.behind_bg || scanline[line_x] == 0)
                     {
-                        screen_buffer[line_x + line_y * LCD_WIDTH] = color;
+                        screen_line[line_x] = color;
                     }
                 }
             }
@@ -279,92 +495,208 @@ void Ppu::render_current_scanline()
     }
 }
 
-std::array<uint8_t, 256*256> Ppu::render_tiles_map()
+void Ppu::decode_objects()
 {
-    std::array<uint8_t, 256*256> screen_buffer {0};
-    std::array<uint8_t, 256*256> raw_bg_plt_idx {0};
+    for (int n = 0; n < 40; ++n)
+    {
+        const auto attributes = ObjAttribs{ obj_attribute_memory[n*4+3] };
+        objects[n] = Object{
+            obj_attribute_memory[n*4+0] - 16,
+            obj_attribute_memory[n*4+1] - 8,
+            obj_attribute_memory[n*4+2],
+            attributes.pallete_number,
+            attributes.x_flip,
+            attributes.y_flip,
+            attributes.bg_window_over,
+        };
+    }
+    objects_dirty = false;
+}
 
-    std::uint8_t scanline[LCD_WIDTH] = {0};
+void Ppu::scan_oam()
+{
+    if (objects_dirty)
+    {
+        decode_objects();
+    }
 
-    auto draw_tile = [&](int x_pos, int y_pos, int tile_index, int tiles_offset, bool obj, ObjAttribs attribs)
+    line_object_height = lcd_control.big_obj ? 16 : 8;
+    line_object_count = 0;
+
+    //X plays no part in the selection, objects off the sides still use up a slot
+    for (int n = 0; n < 40 && line_object_count < MAX_LINE_OBJECTS; ++n)
     {
-        for (int y=0; y<8; ++y) for (int x=0; x<8; ++x)
+        const auto &object = objects[n];
+        if (object.y <= line_y && line_y < object.y + line_object_height)
         {
-            if (x_pos + x < 0 || x_pos + x > 255
-                    || y_pos + y < 0 || y_pos + y > 255) continue;
+            //Insertion keeps OAM order among equal X
+            int i = line_object_count++;
+            for ( ; i > 0 && objects[line_objects[i-1]].x > object.x; --i)
+            {
+                line_objects[i] = line_objects[i-1];
+            }
+            line_objects[i] = n;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Lines are composed with 8 pixels of padding on both sides, so objects
+// hanging off either edge need no clipping
+static const int LINE_PADDING = 8;
+
+// A tile row of pixel indices, 8 bytes that move as one
+static void copy_tile_row(std::uint8_t *destination, const std::uint8_t *row)
+{
+    std::memcpy(destination, row, 8);
+}
+
+// Pixel indices go through a 4-entry palette with one byte shuffle
+__attribute__((target("ssse3")))
+static __m128i palette_table(Ppu::Palette palette)
+{
+    return _mm_setr_epi8(palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+__attribute__((target("ssse3")))
+static void render_scanline_ssse3(Ppu &ppu)
+{
+    auto &lcd_control = ppu.lcd_control;
+    const int line_y = ppu.line_y;
+    const int tiles_offset = ppu.tiles_offset();
+    auto screen_line = ppu.back_buffer() + line_y * LCD_WIDTH;
 
-            auto pix = tile_pixel_value(tile_index, x, y, tiles_offset);
+    //Background indices decide object priority, color indices also have the window drawn in
+    alignas(16) std::uint8_t bg_indices[LINE_PADDING + LCD_WIDTH + 16] = {0};
+    alignas(16) std::uint8_t color_indices[LINE_PADDING + LCD_WIDTH + 16] = {0};
+    alignas(16) std::uint8_t line[LINE_PADDING + LCD_WIDTH + LINE_PADDING] = {0};
 
-            auto buffer_index = x_pos + x + (y_pos + y)*256;
-            if ( ! obj )
+    if (lcd_control.bg_window_enable)
+    {
+        int map_offset = lcd_control.bg_tile_map_area == 0
+                ? 0x9800-0x8000
+                : 0x9C00-0x8000;
+
+        const int scrolled_y = line_y + ppu.lcd_scroll_y;
+        const int tile_y = (scrolled_y % 256) / 8;
+        const int y_in_tile = scrolled_y % 8;
+
+        //21 whole tile rows cover 160 pixels at any fine scroll
+        auto destination = bg_indices + LINE_PADDING - ppu.lcd_scroll_x % 8;
+        for (int tile = 0; tile < LCD_WIDTH / 8 + 1; ++tile)
+        {
+            const int tile_x = (ppu.lcd_scroll_x / 8 + tile) % 32;
+            const int tile_index = ppu.tile_index_on_map(map_offset, tile_x, tile_y);
+            copy_tile_row(destination + tile * 8, ppu.tile_row(ppu.tile_number(tile_index, tiles_offset), y_in_tile, false));
+        }
+        std::memcpy(color_indices + LINE_PADDING, bg_indices + LINE_PADDING, LCD_WIDTH);
+
+        const int window_y = line_y - ppu.window_y_pos;
+        if (lcd_control.window_enable && 0 <= window_y && window_y < LCD_HEIGHT)
+        {
+            map_offset = lcd_control.window_tile_map_area == 0
+                    ? 0x9800-0x8000
+                    : 0x9C00-0x8000;
+
+            const int line_x = std::max(0, 7 - ppu.window_x_pos);
+            const int window_x = line_x + ppu.window_x_pos - 7;
+            const int width = std::min(LCD_WIDTH - line_x, LCD_WIDTH - window_x);
+
+            alignas(16) std::uint8_t window_indices[LCD_WIDTH + 8];
+            for (int tile = window_x / 8; tile * 8 < window_x + width; ++tile)
             {
-                raw_bg_plt_idx[buffer_index] = pix;
-                auto plt_color = bg_palette_data[pix];
-                screen_buffer[buffer_index] = plt_color;
+                const int tile_index = ppu.tile_index_on_map(map_offset, tile, window_y / 8);
+                copy_tile_row(window_indices + tile * 8 - window_x / 8 * 8, ppu.tile_row(ppu.tile_number(tile_index, tiles_offset), window_y % 8, false));
             }
-            else if ( raw_bg_plt_idx[buffer_index] == 0 || ! attribs.bg_window_over )
+            if (width > 0)
             {
-                if (attribs.x_flip && attribs.y_flip)
-                {
-                    pix = tile_pixel_value(tile_index, 7-x, 7-y, tiles_offset);
-                }
-                else if (attribs.x_flip)
-                {
-                    pix = tile_pixel_value(tile_index, 7-x, y, tiles_offset);
-                }
-                else if (attribs.y_flip)
-                {
-                    pix = tile_pixel_value(tile_index, x, 7-y, tiles_offset);
-                }
-
-                if (pix > 0)
-                {
-                    auto plt_color = obj_palette_data[attribs.pallete_number][pix];
-                    screen_buffer[buffer_index] = plt_color;
-                }
+                std::memcpy(color_indices + LINE_PADDING + line_x, window_indices + window_x % 8, width);
             }
         }
-    };
-
-    int map_offset = lcd_control.bg_tile_map_area == 0
-            ? 0x9800-0x8000
-            : 0x9C00-0x8000;
 
-    //Draw background
-    for (int ty=0; ty<32; ++ty) for (int tx=0; tx<32; ++tx)
-    {
-        auto x_pos = (tx*8 - lcd_scroll_x + 256)%256;
-        auto y_pos = (ty*8 - lcd_scroll_y + 256)%256;
-        int tile_index = video_ram[map_offset+tx+ty*32];
-        if (lcd_control.bg_window_tile_data_area==0)
+        const __m128i palette = palette_table(ppu.bg_palette_data);
+        for (int x = 0; x < LCD_WIDTH; x += 16)
         {
-            tile_index = int8_t(tile_index);
+            const __m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(color_indices + LINE_PADDING + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(line + LINE_PADDING + x), _mm_shuffle_epi8(palette, indices));
         }
-
-        draw_tile(x_pos, y_pos, tile_index, tiles_offset(), false, {0});
     }
 
-    //Draw sprites
-    for (int s=0; s<40*4; s+=4)
+    if (lcd_control.obj_enable)
     {
-        auto sy = obj_attribute_memory[s+0];
-        auto sx = obj_attribute_memory[s+1];
-        auto tile = obj_attribute_memory[s+2];
-        ObjAttribs attribs;
-        attribs.value = obj_attribute_memory[s+3];
-
-        draw_tile(sx-8, sy-16, tile, 0, true, attribs);
+        const int obj_height = ppu.line_object_height;
+        const __m128i obj_palettes[2] = { palette_table(ppu.obj_palette_data[0]), palette_table(ppu.obj_palette_data[1]) };
+        const __m128i zero = _mm_setzero_si128();
+        alignas(16) std::uint8_t taken[LINE_PADDING + LCD_WIDTH + LINE_PADDING] = {0};
 
-        if (lcd_control.big_obj)
+        for (int i = 0; i < ppu.line_object_count; ++i)
         {
-            draw_tile(sx-8, sy-8, tile+1, 0, true, attribs);
+            const auto &object = ppu.objects[ppu.line_objects[i]];
+            if (object.x >= LCD_WIDTH)
+            {
+                continue;
+            }
+
+            const int y_in_tile = object.y_flip
+                    ? (obj_height-1) - (line_y - object.y)
+                    : line_y - object.y;
+
+            const auto x = LINE_PADDING + object.x;
+            const __m128i pixels = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(ppu.tile_row(ppu.object_tile(object), y_in_tile, object.x_flip)));
+
+            //Color 0 is transparent. An opaque pixel hides the objects after it even where
+            //it is itself behind background colors 1-3
+            const __m128i opaque = _mm_andnot_si128(_mm_cmpeq_epi8(pixels, zero), _mm_set1_epi8(-1));
+            const __m128i earlier = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(taken + x));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(taken + x), _mm_or_si128(earlier, opaque));
+
+            __m128i drawn = _mm_andnot_si128(earlier, opaque);
+            if (object.behind_bg)
+            {
+                const __m128i background = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(bg_indices + x));
+                drawn = _mm_and_si128(drawn, _mm_cmpeq_epi8(background, zero));
+            }
+
+            const __m128i colors = _mm_shuffle_epi8(obj_palettes[object.palette], pixels);
+            const __m128i below = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(line + x));
+            const __m128i merged = _mm_or_si128(_mm_and_si128(drawn, colors), _mm_andnot_si128(drawn, below));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(line + x), merged);
         }
+    }
+
+    std::memcpy(screen_line, line + LINE_PADDING, LCD_WIDTH);
+}
+
+static bool has_ssse3()
+{
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+}
 
+void Ppu::render_current_scanline()
+{
+    static const bool ssse3 = has_ssse3();
+    if (ssse3)
+    {
+        decode_dirty_tiles();
+        render_scanline_ssse3(*this);
+    }
+    else
+    {
+        render_scanline_reference();
     }
+}
 
-    return screen_buffer;
+#else
+
+void Ppu::render_current_scanline()
+{
+    render_scanline_reference();
 }
 
+#endif
+
 uint8_t Ppu::read(uint16_t address) const
 {
     switch (address)
@@ -410,28 +742,60 @@ void Ppu::write(uint16_t address, uint8_t value)
     if (0xFE00 <= address  && address <= 0xFE9F)
     {
         obj_attribute_memory[address - 0xFE00] = value;
+        objects_dirty = true;
+        log_write(address, value);
         return;
     }
 
     switch (address)
     {
-        case 0xFF40: lcd_control.value = value; return;
-        case 0xFF41: lcd_status.value = value; return;
-        case 0xFF42: lcd_scroll_y = value; return;
-        case 0xFF43: lcd_scroll_x = value; return;
-        case 0xFF44: break; //line_y is read-only;
-        case 0xFF45: ly_compare = value; return;
-        case 0xFF46: start_dma(bus, value); return;
-        case 0xFF47: bg_palette_data.value = value; return;
-        case 0xFF48: obj_palette_data[0].value = value; return;
-        case 0xFF49: obj_palette_data[1].value = value; return;
-        case 0xFF4A: window_y_pos = value; return;
-        case 0xFF4B: window_x_pos = value; return;
+        case 0xFF40: lcd_control.value = value; break;
+        case 0xFF41: lcd_status.value = value; break;
+        case 0xFF42: lcd_scroll_y = value; break;
+        case 0xFF43: lcd_scroll_x = value; break;
+        case 0xFF45: ly_compare = value; break;
+        case 0xFF46: start_dma(bus, value); return; //Logged as the OAM writes it makes
+        case 0xFF47: bg_palette_data.value = value; break;
+        case 0xFF48: obj_palette_data[0].value = value; break;
+        case 0xFF49: obj_palette_data[1].value = value; break;
+        case 0xFF4A: window_y_pos = value; break;
+        case 0xFF4B: window_x_pos = value; break;
+        case 0xFF44: //line_y is read-only;
+        default:
+        {
+            std::ostringstream out;
+            out <<  "PPU write to " << std::hex << address << " not yet implemented";
+            throw std::runtime_error(out.str());
+        }
     }
 
-    std::ostringstream out;
-    out <<  "PPU write to " << std::hex << address << " not yet implemented";
-    throw std::runtime_error(out.str());
+    log_write(address, value);
 }
 
 
+
+void Ppu::serialize(SaveState &state)
+{
+    state(video_ram)(obj_attribute_memory)
+         (lcd_control)(lcd_status)(lcd_scroll_y)(lcd_scroll_x)(line_y)(ly_compare)
+         (bg_palette_data)(obj_palette_data)(window_y_pos)(window_x_pos)
+         (line_tick)(frame_ready)
+         (line_objects)(line_object_count)(line_object_height);
+
+    //VRAM and OAM may have been replaced wholesale. The objects are needed right
+    //away, line_objects points into them for a line loaded between scan and draw
+    if (state.is_loading())
+    {
+        invalidate_tiles();
+        decode_objects();
+    }
+
+    if (renderer && state.is_loading())
+    {
+        renderer->resync();
+    }
+    if (deferred && state.is_loading())
+    {
+        deferred->resync();
+    }
+}
@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
-#include <array>
+#include <memory>
+#include <mutex>
 
 struct Bus;
+class SaveState;
+class ThreadedRenderer;
+class DeferredRenderer;
 
 class Ppu
 {
@@ -16,8 +22,11 @@ public:
     };
 
     Ppu(Bus &bus);
+    ~Ppu();
 
     void run_ounce();
+    // The screen buffer is left out, the next frame redraws it
+    void serialize(SaveState &state);
 
     std::uint8_t read(std::uint16_t address) const;
     void write(std::uint16_t address, std::uint8_t value);
@@ -26,6 +35,7 @@ public:
 
     // 0x8000 - 0x97FF : CHR RAM
     std::uint8_t video_ram[0x2000];
+    static const int TILE_COUNT = 384;
     // 0xFE00 - 0xFE9F : Object Attribute Memory
     std::uint8_t obj_attribute_memory[0x100];
 
@@ -103,6 +113,17 @@ public:
     int line_tick = -1;
     bool frame_ready = false;
 
+    // Skipped frames keep their timing and interrupts but draw no pixels.
+    // 1 renders every frame, N every Nth one, 0 only the ones asked for.
+    int render_interval = 1;
+    /// Renders the next frame that starts whatever the interval says
+    void request_frame() { frame_requested = true; }
+    std::uint64_t rendered_frames = 0;
+    std::uint64_t skipped_frames = 0;
+    // Decided at the start of each frame
+    bool render_frame = true;
+    bool frame_requested = false;
+
     int tiles_offset() const {
         return lcd_control.bg_window_tile_data_area == 0
             ? 0x9000-0x8000
@@ -112,9 +133,123 @@ public:
     int tile_index_on_map(int map_offset, int tile_x, int tile_y);
     int tile_pixel_value(int tile_index, int x, int y, int tiles_offset);
 
-    std::uint8_t screen_buffer[160*256];
-    void render_current_scanline();
+    // Every write to VRAM goes through here, so the decoded tiles know what to redo
+    void write_vram(std::uint16_t offset, std::uint8_t value)
+    {
+        video_ram[offset] = value;
+        if (offset < TILE_COUNT * 16)
+        {
+            dirty_tiles[offset >> 10] |= std::uint64_t(1) << ((offset >> 4) & 63);
+        }
+        if (renderer || deferred)
+        {
+            log_vram_write(offset, value);
+        }
+    }
+
+    // Pixel indices 0-3 of each row of each tile, as stored and mirrored horizontally
+    std::uint8_t decoded_tiles[2][TILE_COUNT][8][8];
+    std::uint64_t dirty_tiles[TILE_COUNT / 64];
+    // Bumped whenever a tile is decoded again, lets viewers redraw only what changed
+    std::uint32_t tile_versions[TILE_COUNT] = {};
+
+    /// Decodes the tiles written since the last call
+    void decode_dirty_tiles();
+    void invalidate_tiles();
+
+    // tile counts from 0x8000, y may run into the following tile for 8x16 objects
+    const std::uint8_t *tile_row(int tile, int y, bool x_flip) const
+    {
+        return decoded_tiles[x_flip][tile + y / 8][y % 8];
+    }
+    int tile_number(int tile_index, int tiles_offset) const { return tiles_offset / 16 + tile_index; }
 
-    std::array<std::uint8_t,256*256> render_tiles_map();
+    // OAM entry decoded, rebuilt only after OAM was written
+    struct Object
+    {
+        int y;
+        int x;
+        std::uint8_t tile;
+        std::uint8_t palette;
+        bool x_flip;
+        bool y_flip;
+        bool behind_bg;
+    };
+    Object objects[40];
+    bool objects_dirty = true;
+
+    // Objects on the current line as picked by the mode 2 scan, highest priority first
+    static const int MAX_LINE_OBJECTS = 10;
+    std::uint8_t line_objects[MAX_LINE_OBJECTS];
+    int line_object_count = 0;
+    int line_object_height = 8;
+
+    /// The first 10 objects in OAM covering line_y, sorted by X then OAM index
+    void scan_oam();
+    void decode_objects();
+    // The objects the current line was scanned with, OAM may have changed since
+    void copy_objects(const Ppu &other) { std::copy(other.objects, other.objects + 40, objects); }
+    // 8x16 objects ignore the low tile bit, the pair always starts on an even tile
+    int object_tile(const Object &object) const { return line_object_height == 16 ? object.tile & 0xFE : object.tile; }
+
+    // Shades 0-3 of the frame being drawn and of the last completed one, swapped at VBlank
+    std::uint8_t frame_buffers[2][160*144] = {};
+    int back_index = 0;
+    std::uint64_t completed_frames = 0;
+    std::mutex front_mutex;
+
+    std::uint8_t *back_buffer() { return frame_buffers[back_index]; }
+    void swap_frame_buffers();
+
+    // The last completed frame, which stays put until the Frame is gone. Any thread may hold
+    // one: the PPU never waits for it, it keeps drawing into the back buffer instead of swapping.
+    struct Frame
+    {
+        std::unique_lock<std::mutex> lock;
+        const std::uint8_t *pixels;
+        // Completed frames so far, tells a reader whether this one is new
+        std::uint64_t number;
+    };
+    Frame acquire_frame();
+
+    // Caller's framebuffer that finished lines are also written to, each of the four
+    // shades replaced by its entry in palette. RGBA8888 takes the palette entries as
+    // 32-bit values, RGB565 as 16-bit ones, INDEXED8 as bytes.
+    struct OutputSurface
+    {
+        enum Format { RGBA8888, RGB565, INDEXED8 };
+
+        Format format = RGBA8888;
+        void *pixels = nullptr;
+        // Bytes from one line to the next
+        std::size_t pitch = 0;
+        std::uint32_t palette[4] = {};
+    };
+    OutputSurface output;
+    /// Pass an OutputSurface without pixels to stop writing to the last one
+    void set_output_surface(const OutputSurface &surface);
+    void write_output_line();
+
+    // Lines drawn on a worker thread from a log of what the emulation did, which then
+    // owns the frame buffers and the output surface. The pixels come out the same.
+    void set_threaded_rendering(bool enable);
+    bool threaded_rendering() const { return renderer != nullptr; }
+    std::unique_ptr<ThreadedRenderer> renderer;
+    // Lines drawn all at once at VBlank from what each was set up with, which takes
+    // the rendering out of mode 3. Same ownership as threaded, and the same pixels.
+    void set_deferred_rendering(bool enable);
+    bool deferred_rendering() const { return deferred != nullptr; }
+    std::unique_ptr<DeferredRenderer> deferred;
+    void log_vram_write(std::uint16_t offset, std::uint8_t value);
+    void log_write(std::uint16_t address, std::uint8_t value);
+    // The PPU drawing the frames, this one or a renderer's shadow
+    Ppu &frame_owner();
+    /// Carries on with the frames and the output surface of another PPU
+    void adopt_frames(Ppu &other);
+
+    // Vector path when the CPU has SSSE3, otherwise the reference
+    void render_current_scanline();
+    // One pixel at a time, the vector path has to match it byte for byte
+    void render_scanline_reference();
 };
 
@@ -0,0 +1,42 @@
+#include "recompiled.h"
+#include "rom_image.h"
+
+static std::vector<const RecompiledRom *> &recompiled_roms()
+{
+    static std::vector<const RecompiledRom *> roms;
+    return roms;
+}
+
+std::uint64_t rom_hash(const RomImage &rom)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ull;
+    for (auto byte : rom)
+    {
+        hash = (hash ^ byte) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool register_recompiled_rom(const RecompiledRom &rom)
+{
+    recompiled_roms().push_back(&rom);
+    return true;
+}
+
+const RecompiledRom *find_recompiled_rom(const RomImage &rom_image)
+{
+    if (recompiled_roms().empty())
+    {
+        return nullptr;
+    }
+
+    const auto hash = rom_hash(rom_image);
+    for (auto rom : recompiled_roms())
+    {
+        if (rom->rom_size == rom_image.size() && rom->rom_hash == hash)
+        {
+            return rom;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "system.h"
+#include "instructions.h"
+
+#include <cstdint>
+#include <vector>
+
+class RomImage;
+
+// Code translated ahead of time by --recompile for one particular ROM.
+// Every block starts at a ROM offset, runs instructions until the next branch
+// and returns the ticks it used. Peripherals run after every instruction and
+// the block stops early on interrupts, HALT and bank switches, so a block
+// behaves exactly like the same number of System::tick calls.
+struct RecompiledRom
+{
+    using Block = std::size_t (*)(System &);
+
+    std::uint64_t rom_hash;
+    std::size_t rom_size;
+    Block (*find_block)(std::size_t rom_offset);
+};
+
+std::uint64_t rom_hash(const RomImage &rom);
+
+// Generated files register themselves during static initialization
+bool register_recompiled_rom(const RecompiledRom &rom);
+const RecompiledRom *find_recompiled_rom(const RomImage &rom);
+
+/// Executes one already fetched instruction, like Cpu::run_once followed by the peripherals
+template<std::uint16_t OPCODE>
+inline std::size_t recompiled_step(System &system)
+{
+    using Inst = Instruction<OPCODE>;
+    using Impl = typename Inst::impl_type;
+
+    std::size_t ticks = Inst::ticks;
+    if constexpr (Inst::ticks == 0)
+    {
+        ticks = Impl::execute(system.cpu);
+    }
+    else
+    {
+        Impl::execute(system.cpu);
+    }
+
+    system.run_peripherals(ticks);
+    return ticks;
+}
+
+/// True when the rest of the block can't run: System::tick has an interrupt
+/// to dispatch, the CPU halted, a serial transfer waits for the link cable to
+/// exchange it, or the code below pc may have been switched out
+inline bool recompiled_exit(const System &system, std::uint32_t bank_switches)
+{
+    const auto &cpu = system.cpu;
+    return cpu.halted
+        || system.serial.completion_pending
+        || system.cart.bank_switches != bank_switches
+        || (cpu.inerrupts_master_enable_flag
+            && (system.interrupts.enable_register & system.interrupts.trigger_register & 0x1F));
+}
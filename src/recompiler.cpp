@@ -0,0 +1,343 @@
+#include "recompiler.h"
+
+#include "recompiled.h"
+
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+// Blocks end at the first branch, this only bounds straight line code
+static const int MAX_BLOCK_INSTRUCTIONS = 512;
+
+namespace
+{
+
+enum : std::uint8_t
+{
+    VISITED = 1 << 0, //An instruction starts here
+    ENTRY   = 1 << 1, //A block starts here
+};
+
+struct Recompiler
+{
+    const RomImage &rom;
+    std::size_t banks;
+
+    std::vector<std::uint8_t> flags;
+    std::deque<std::pair<std::size_t, int>> pending;
+    std::size_t unresolved_branches = 0;
+
+    Recompiler(const RomImage &rom)
+        : rom(rom)
+        , banks(rom.size() / 0x4000)
+        , flags(rom.size(), 0)
+    {
+    }
+
+    //Address the CPU sees the offset at while its bank is mapped in
+    static std::uint16_t address_of(std::size_t offset)
+    {
+        return offset <= 0x3FFF ? offset : 0x4000 | (offset & 0x3FFF);
+    }
+
+    void add_entry(std::size_t offset, int bank)
+    {
+        if (offset >= rom.size())
+        {
+            return;
+        }
+        flags[offset] |= ENTRY;
+        if ( ! (flags[offset] & VISITED))
+        {
+            pending.emplace_back(offset, bank);
+        }
+    }
+
+    //bank is the switchable bank mapped in at the branch, if known
+    void add_branch(std::uint16_t target, std::size_t from, int bank)
+    {
+        if (target <= 0x3FFF)
+        {
+            add_entry(target, bank);
+            return;
+        }
+
+        if (target <= 0x7FFF)
+        {
+            if (bank < 0 && from > 0x3FFF)
+            {
+                bank = from / 0x4000;
+            }
+            if (bank < 0 && banks == 2)
+            {
+                bank = 1;
+            }
+            if (bank > 0)
+            {
+                add_entry(bank * 0x4000 + target - 0x4000, bank);
+                return;
+            }
+        }
+
+        //RAM resident code and banks only known at run time stay with the interpreter
+        ++unresolved_branches;
+    }
+
+    //Follows the code from one entry point, queueing every branch target found
+    void walk(std::size_t offset, int bank)
+    {
+        //Constants tracked to resolve "LD A,n / LD (2000),A" style bank switches
+        int a = -1;
+        int hl = -1;
+
+        while (offset < rom.size())
+        {
+            if (flags[offset] & VISITED)
+            {
+                flags[offset] |= ENTRY;
+                return;
+            }
+
+            const std::uint8_t opcode = rom[offset];
+            const std::size_t size = INSTRUCTION_SIZES[opcode];
+            const std::size_t next = offset + size;
+            if (size == 0 || next > rom.size() || (offset / 0x4000) != ((next - 1) / 0x4000))
+            {
+                return;
+            }
+
+            flags[offset] |= VISITED;
+
+            const std::uint16_t address = address_of(offset);
+            const std::uint8_t d8 = size > 1 ? rom[offset + 1] : 0;
+            const std::uint16_t d16 = size > 2 ? d8 | rom[offset + 2] << 8 : 0;
+
+            switch (opcode)
+            {
+                case 0x18: //JR
+                    add_branch(address + 2 + std::int8_t(d8), offset, bank);
+                    return;
+
+                case 0x20: case 0x28: case 0x30: case 0x38: //JR cc
+                    add_branch(address + 2 + std::int8_t(d8), offset, bank);
+                    add_entry(next, bank);
+                    return;
+
+                case 0xC3: //JP
+                    add_branch(d16, offset, bank);
+                    return;
+
+                case 0xC2: case 0xCA: case 0xD2: case 0xDA: //JP cc
+                case 0xC4: case 0xCC: case 0xD4: case 0xDC: //CALL cc
+                case 0xCD:                                  //CALL
+                    add_branch(d16, offset, bank);
+                    add_entry(next, bank);
+                    return;
+
+                case 0xC7: case 0xCF: case 0xD7: case 0xDF: //RST
+                case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+                    add_branch(opcode & 0x38, offset, bank);
+                    add_entry(next, bank);
+                    return;
+
+                case 0xC0: case 0xC8: case 0xD0: case 0xD8: //RET cc
+                    add_entry(next, bank);
+                    return;
+
+                case 0xE9: //JP (HL)
+                    ++unresolved_branches;
+                    return;
+
+                case 0xC9: //RET
+                case 0xD9: //RETI
+                    return;
+            }
+
+            //Bank switches, the code below the switchable bank changes with them
+            const int store = opcode == 0xEA ? d16 : opcode == 0x77 ? hl : -1;
+            if (0x2000 <= store && store <= 0x3FFF)
+            {
+                bank = a < 0 ? -1 : a == 0 ? 1 : a % banks;
+                if (offset > 0x3FFF)
+                {
+                    if (bank > 0)
+                    {
+                        add_entry(bank * 0x4000 + address_of(next) - 0x4000, bank);
+                    }
+                    return;
+                }
+            }
+
+            switch (opcode)
+            {
+                case 0x3E: a = d8; break;
+                case 0xAF: a = 0; break;
+                case 0x21: hl = d16; break;
+
+                //Leave both A and HL alone
+                case 0x00: case 0xEA: case 0x77: case 0xE0:
+                case 0x01: case 0x11: case 0x31:
+                case 0xC5: case 0xD5: case 0xE5: case 0xF5:
+                case 0x06: case 0x0E: case 0x16: case 0x1E:
+                    break;
+
+                default:
+                    a = -1;
+                    hl = -1;
+            }
+
+            offset = next;
+            if (offset % 0x4000 == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    static bool ends_block(std::uint8_t opcode)
+    {
+        switch (opcode)
+        {
+            case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+            case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9:
+            case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+            case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9:
+            case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+                return true;
+        }
+        return false;
+    }
+
+    //Writes one block function, returns the number of instructions in it
+    int emit_block(std::ostream &out, std::size_t offset)
+    {
+        out << "static std::size_t block_" << std::setw(6) << offset << "(System &system)\n"
+            << "{\n"
+            << "    auto &cpu = system.cpu;\n"
+            << "    const auto bank_switches = system.cart.bank_switches;\n"
+            << "    std::size_t ticks = 0;\n";
+
+        int count = 0;
+        while (true)
+        {
+            const std::uint8_t opcode = rom[offset];
+            const std::size_t size = INSTRUCTION_SIZES[opcode];
+            const std::size_t next = offset + size;
+            const std::uint16_t address = address_of(offset);
+
+            out << "\n    //" << std::setw(4) << address << ":";
+            for (std::size_t i=0; i<size; ++i)
+            {
+                out << " " << std::setw(2) << int(rom[offset + i]);
+            }
+            out << "\n    cpu.registers.pc = 0x" << std::setw(4) << std::uint16_t(address + size) << ";\n";
+            if (size > 1)
+            {
+                out << "    cpu.arg1 = 0x" << std::setw(2) << int(rom[offset + 1]) << ";\n";
+            }
+            if (size > 2)
+            {
+                out << "    cpu.arg2 = 0x" << std::setw(2) << int(rom[offset + 2]) << ";\n";
+            }
+            const int instruction = opcode == 0xCB ? 0xCB00 | rom[offset + 1] : opcode;
+            out << "    ticks += recompiled_step<0x" << std::setw(opcode == 0xCB ? 4 : 2) << instruction << ">(system);\n";
+            ++count;
+
+            const bool last = ends_block(opcode)
+                    || (opcode == 0xEA && (rom[offset + 1] | rom[offset + 2] << 8) <= 0x7FFF)
+                    || next >= rom.size()
+                    || next % 0x4000 == 0
+                    || (flags[next] & ENTRY)
+                    || INSTRUCTION_SIZES[rom[next]] == 0
+                    || (next / 0x4000) != ((next + INSTRUCTION_SIZES[rom[next]] - 1) / 0x4000)
+                    || count == MAX_BLOCK_INSTRUCTIONS;
+            if (last)
+            {
+                break;
+            }
+
+            out << "    if (recompiled_exit(system, bank_switches)) return ticks;\n";
+            offset = next;
+        }
+
+        out << "    return ticks;\n"
+            << "}\n\n";
+
+        return count;
+    }
+};
+
+}
+
+int recompile_rom(const std::string &rom_file, const std::string &output_file)
+{
+    Cartridge cart(rom_file);
+    const auto &rom = *cart.rom_image;
+    if (rom.size() < 0x8000 || rom.size() % 0x4000)
+    {
+        throw std::runtime_error("Unexpected ROM size: " + std::to_string(rom.size()));
+    }
+
+    Recompiler recompiler(rom);
+
+    //Entry point, RST and interrupt vectors
+    recompiler.add_entry(0x100, -1);
+    for (std::size_t vector = 0x00; vector <= 0x60; vector += 8)
+    {
+        recompiler.add_entry(vector, -1);
+    }
+
+    while ( ! recompiler.pending.empty())
+    {
+        const auto [offset, bank] = recompiler.pending.front();
+        recompiler.pending.pop_front();
+        recompiler.walk(offset, bank);
+    }
+
+    std::ofstream out(output_file);
+    if ( ! out)
+    {
+        throw std::runtime_error("Unable to open file: " + output_file);
+    }
+
+    out << "// Generated by gb --recompile from " << rom_file << ", do not edit.\n"
+        << "// Only used for the ROM with the hash below, other ROMs keep using the interpreter.\n\n"
+        << "#include \"recompiled.h\"\n\n"
+        << std::hex << std::setfill('0');
+
+    std::vector<std::size_t> blocks;
+    std::size_t instructions = 0;
+    for (std::size_t offset = 0; offset < rom.size(); ++offset)
+    {
+        const bool valid = (recompiler.flags[offset] & (ENTRY | VISITED)) == (ENTRY | VISITED);
+        if (valid)
+        {
+            instructions += recompiler.emit_block(out, offset);
+            blocks.push_back(offset);
+        }
+    }
+
+    out << "static RecompiledRom::Block find_block(std::size_t rom_offset)\n"
+        << "{\n"
+        << "    switch (rom_offset)\n"
+        << "    {\n";
+    for (auto offset : blocks)
+    {
+        out << "        case 0x" << std::setw(6) << offset << ": return block_" << std::setw(6) << offset << ";\n";
+    }
+    out << "    }\n"
+        << "    return nullptr;\n"
+        << "}\n\n"
+        << "static const RecompiledRom recompiled_rom = { 0x" << std::setw(16) << rom_hash(rom) << "ull, "
+        << std::dec << rom.size() << ", find_block };\n"
+        << "static const bool registered = register_recompiled_rom(recompiled_rom);\n";
+
+    std::cout << "Blocks              : " << blocks.size() << "\n"
+              << "Instructions        : " << instructions << "\n"
+              << "Unresolved branches : " << recompiler.unresolved_branches << "\n"
+              << "Written to " << output_file << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+// Translates the statically reachable code of a ROM into a C++ file of
+// RecompiledRom blocks. Rebuilding with the file in recompiled/ links it in,
+// and every System running that exact ROM uses it from then on.
+int recompile_rom(const std::string &rom_file, const std::string &output_file);
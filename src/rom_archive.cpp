@@ -0,0 +1,180 @@
+#include "rom_archive.h"
+
+#include "checksums.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+// Far above the 8 MiB of the largest cartridges, guards against a corrupt size field
+static const std::size_t MAX_ROM_SIZE = 64 << 20;
+
+static std::uint32_t read32(const std::uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | std::uint32_t(data[3]) << 24;
+}
+
+static std::uint16_t read16(const std::uint8_t *data)
+{
+    return data[0] | data[1] << 8;
+}
+
+bool is_compressed_rom(const std::uint8_t *data, std::size_t size)
+{
+    const bool gzip = size >= 18 && data[0] == 0x1F && data[1] == 0x8B;
+    const bool zip = size >= 30 && read32(data) == 0x04034B50;
+    return gzip || zip;
+}
+
+// window_bits picks the container: 16+ for gzip, negative for raw deflate in zip
+static void inflate_into(const std::uint8_t *input, std::size_t input_size, std::vector<std::uint8_t> &output, int window_bits, const std::string &filename)
+{
+    z_stream stream = {};
+    if (inflateInit2(&stream, window_bits) != Z_OK)
+    {
+        throw std::runtime_error("Unable to start decompressing: " + filename);
+    }
+
+    stream.next_in = const_cast<Bytef *>(input);
+    stream.avail_in = input_size;
+    stream.next_out = output.data();
+    stream.avail_out = output.size();
+
+    const int result = inflate(&stream, Z_FINISH);
+    const auto produced = stream.total_out;
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END || produced != output.size())
+    {
+        throw std::runtime_error("Corrupt or truncated archive: " + filename);
+    }
+}
+
+static std::vector<std::uint8_t> decompress_gzip(const std::uint8_t *data, std::size_t size, const std::string &filename)
+{
+    //ISIZE, the uncompressed size modulo 2^32, ends the stream
+    const std::size_t rom_size = read32(data + size - 4);
+    if (rom_size > MAX_ROM_SIZE)
+    {
+        throw std::runtime_error("Corrupt or truncated archive: " + filename);
+    }
+
+    std::vector<std::uint8_t> rom(rom_size);
+    inflate_into(data, size, rom, 16 + MAX_WBITS, filename);
+    return rom;
+}
+
+static bool is_rom_name(const std::string &name)
+{
+    auto ends_with = [&](const std::string &suffix)
+    {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return ends_with(".gb") || ends_with(".gbc") || ends_with(".GB") || ends_with(".GBC");
+}
+
+static std::vector<std::uint8_t> decompress_zip(const std::uint8_t *data, std::size_t size, const std::string &filename)
+{
+    //End of central directory record, followed by a comment of up to 64 KiB
+    std::size_t end_record = size;
+    const std::size_t lowest = size > 22 + 0xFFFF ? size - 22 - 0xFFFF : 0;
+    for (std::size_t offset = size - 22 + 1; offset-- > lowest; )
+    {
+        if (read32(data + offset) == 0x06054B50)
+        {
+            end_record = offset;
+            break;
+        }
+    }
+    if (end_record == size)
+    {
+        throw std::runtime_error("Not a zip archive: " + filename);
+    }
+
+    const std::size_t entries = read16(data + end_record + 10);
+    std::size_t entry = read32(data + end_record + 16);
+
+    //Sizes come from the central directory, local headers may defer them to a data descriptor
+    for (std::size_t n=0; n<entries; ++n)
+    {
+        if (entry + 46 > size || read32(data + entry) != 0x02014B50)
+        {
+            throw std::runtime_error("Corrupt zip directory: " + filename);
+        }
+
+        const auto method = read16(data + entry + 10);
+        const auto crc = read32(data + entry + 16);
+        const auto compressed_size = read32(data + entry + 20);
+        const auto uncompressed_size = read32(data + entry + 24);
+        const auto name_size = read16(data + entry + 28);
+        const auto extra_size = read16(data + entry + 30);
+        const auto comment_size = read16(data + entry + 32);
+        const auto local_header = read32(data + entry + 42);
+        if (entry + 46 + name_size + extra_size + comment_size > size)
+        {
+            throw std::runtime_error("Corrupt zip directory: " + filename);
+        }
+        const std::string name(reinterpret_cast<const char *>(data + entry + 46), name_size);
+
+        entry += 46 + name_size + extra_size + comment_size;
+
+        if ( ! is_rom_name(name))
+        {
+            continue;
+        }
+
+        if (compressed_size == 0xFFFFFFFF || uncompressed_size == 0xFFFFFFFF || local_header == 0xFFFFFFFF)
+        {
+            throw std::runtime_error("ZIP64 archives are not supported: " + filename);
+        }
+        if (uncompressed_size > MAX_ROM_SIZE)
+        {
+            throw std::runtime_error("Archived ROM is too large: " + filename);
+        }
+        if (std::size_t(local_header) + 30 > size || read32(data + local_header) != 0x04034B50)
+        {
+            throw std::runtime_error("Corrupt zip entry: " + filename);
+        }
+
+        const auto content = std::size_t(local_header) + 30 + read16(data + local_header + 26) + read16(data + local_header + 28);
+        if (content + compressed_size > size)
+        {
+            throw std::runtime_error("Truncated zip entry: " + filename);
+        }
+
+        std::vector<std::uint8_t> rom(uncompressed_size);
+        switch (method)
+        {
+            case 0:
+                if (compressed_size != uncompressed_size)
+                {
+                    throw std::runtime_error("Corrupt zip entry: " + filename);
+                }
+                std::copy(data + content, data + content + compressed_size, rom.begin());
+                break;
+            case 8:
+                inflate_into(data + content, compressed_size, rom, -MAX_WBITS, filename);
+                break;
+            default:
+                throw std::runtime_error("Unsupported zip compression method " + std::to_string(method) + ": " + filename);
+        }
+
+        if (crc32(rom.data(), rom.size()) != crc)
+        {
+            throw std::runtime_error("CRC mismatch in zip entry " + name + ": " + filename);
+        }
+        return rom;
+    }
+
+    throw std::runtime_error("No .gb or .gbc file in archive: " + filename);
+}
+
+std::vector<std::uint8_t> decompress_rom(const std::uint8_t *data, std::size_t size, const std::string &filename)
+{
+    if (data[0] == 0x1F && data[1] == 0x8B)
+    {
+        return decompress_gzip(data, size, filename);
+    }
+    return decompress_zip(data, size, filename);
+}
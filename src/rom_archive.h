@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// gzip or zip, recognised by magic number rather than extension
+bool is_compressed_rom(const std::uint8_t *data, std::size_t size);
+
+// Inflates the ROM in a gzip stream, or the first .gb/.gbc entry of a zip
+// archive, into a buffer allocated once at the size the archive declares
+std::vector<std::uint8_t> decompress_rom(const std::uint8_t *data, std::size_t size, const std::string &filename);
@@ -0,0 +1,93 @@
+#include "rom_image.h"
+#include "rom_archive.h"
+#include "rom_patch.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+
+RomImage::RomImage(const std::string &filename) : file(std::make_unique<MappedFile>(filename))
+{
+    bytes = file->data();
+    length = file->size();
+
+    if (is_compressed_rom(bytes, length))
+    {
+        inflated = decompress_rom(bytes, length, filename);
+        file.reset();
+        bytes = inflated.data();
+        length = inflated.size();
+    }
+}
+
+RomImage::RomImage(const RomImage &base, const std::string &filename, const std::string &patch_file)
+{
+    const MappedFile patch(patch_file);
+    length = patched_rom_size(patch.data(), patch.size(), base.data(), base.size(), patch_file);
+
+    if (base.compressed())
+    {
+        inflated.resize(length);
+        std::copy_n(base.data(), std::min(length, base.size()), inflated.data());
+        bytes = inflated.data();
+        apply_rom_patch(patch.data(), patch.size(), base.data(), base.size(), inflated.data(), length, patch_file);
+        return;
+    }
+
+    //The patch reads the original bytes from the base image, its own mapping only gets the changes
+    file = std::make_unique<MappedFile>(filename, length);
+    apply_rom_patch(patch.data(), patch.size(), base.data(), base.size(), file->writable_data(), length, patch_file);
+    file->make_read_only();
+    bytes = file->data();
+}
+
+//The same file, unless it was replaced or rewritten since it was mapped
+using FileKey = std::tuple<dev_t, ino_t, off_t, std::int64_t, long>;
+
+static FileKey file_key(const std::string &filename)
+{
+    struct stat info;
+    if (stat(filename.c_str(), &info) < 0)
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+    return FileKey{ info.st_dev, info.st_ino, info.st_size, info.st_mtim.tv_sec, info.st_mtim.tv_nsec };
+}
+
+std::shared_ptr<const RomImage> RomImage::open(const std::string &filename, const std::string &patch_file)
+{
+    //Opened first so patched images of the same ROM read from one shared base
+    std::shared_ptr<const RomImage> base;
+    if ( ! patch_file.empty())
+    {
+        base = open(filename);
+    }
+
+    using Key = std::pair<FileKey, FileKey>;
+    const Key key{ file_key(filename), patch_file.empty() ? FileKey{} : file_key(patch_file) };
+
+    static std::mutex mutex;
+    static std::map<Key, std::weak_ptr<const RomImage>> images;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto &cached = images[key];
+    if (auto image = cached.lock())
+    {
+        return image;
+    }
+
+    //Drop entries whose images are gone while we are here
+    for (auto it = images.begin(); it != images.end(); )
+    {
+        it = it->second.expired() && &it->second != &cached ? images.erase(it) : std::next(it);
+    }
+
+    auto image = base ? std::make_shared<const RomImage>(*base, filename, patch_file) : std::make_shared<const RomImage>(filename);
+    cached = image;
+    return image;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "mapped_file.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Read-only ROM contents. Every Cartridge of the same file in the process
+// shares one image, and the mapping lets the page cache share it between
+// processes too. Compressed ROMs are inflated into memory instead.
+//
+// A patched image is a copy-on-write mapping of the base file with the IPS or BPS
+// patch written into it, so only the pages the patch touches are private to it.
+class RomImage
+{
+public:
+    static std::shared_ptr<const RomImage> open(const std::string &filename, const std::string &patch_file = "");
+
+    explicit RomImage(const std::string &filename);
+    RomImage(const RomImage &base, const std::string &filename, const std::string &patch_file);
+
+    const std::uint8_t *data() const { return bytes; }
+    std::size_t size() const { return length; }
+    bool compressed() const { return ! file; }
+
+    const std::uint8_t &operator[](std::size_t offset) const { return bytes[offset]; }
+    const std::uint8_t *begin() const { return data(); }
+    const std::uint8_t *end() const { return data() + size(); }
+
+private:
+    std::unique_ptr<MappedFile> file;
+    std::vector<std::uint8_t> inflated;
+    const std::uint8_t *bytes = nullptr;
+    std::size_t length = 0;
+};
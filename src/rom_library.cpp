@@ -0,0 +1,321 @@
+#include "rom_library.h"
+
+#include "cartridge.h"
+#include "rom_image.h"
+#include "battery_writer.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+static const char *INDEX_MAGIC = "gb-library 2";
+
+static std::int64_t modification_time(const fs::path &path)
+{
+    return fs::last_write_time(path).time_since_epoch().count();
+}
+
+// Entries are keyed by absolute path, so any spelling of a ROM's path finds it
+static std::string index_key(const fs::path &path)
+{
+    return fs::absolute(path).lexically_normal().string();
+}
+
+static bool is_rom_file(const fs::path &path)
+{
+    const auto extension = path.extension();
+    return extension == ".gb" || extension == ".gbc" || extension == ".gz" || extension == ".zip";
+}
+
+RomLibraryEntry read_rom_library_entry(const std::string &path, const std::string &cache_directory)
+{
+    RomLibraryEntry entry;
+    entry.path = path;
+    entry.size = fs::file_size(path);
+    entry.mtime = modification_time(path);
+
+    RomImage file(path);
+    const auto *rom = file.data();
+
+    entry.crc32 = crc32(rom, file.size());
+    entry.sha1 = sha1(rom, file.size());
+
+    //Launches through the index map this copy instead of inflating the archive again
+    if (file.compressed())
+    {
+        entry.image = (fs::path(cache_directory) / (to_hex(entry.sha1.data(), entry.sha1.size()) + ".gb")).string();
+        if ( ! fs::exists(entry.image))
+        {
+            //Archives of the same ROM share the copy and may be scanned at the same time,
+            //each writes its own temporary file and the last rename wins with identical data
+            static std::atomic<unsigned> writes { 0 };
+            const auto temp_name = entry.image + "." + std::to_string(getpid()) + "-" + std::to_string(writes++) + ".tmp";
+            fs::create_directories(cache_directory);
+            write_file_atomically(entry.image, rom, file.size(), temp_name);
+        }
+    }
+
+    if (file.size() < 0x150)
+    {
+        return entry;
+    }
+
+    const auto *header = reinterpret_cast<const CartridgeHeader *>(rom + 0x100);
+    entry.title = std::string(header->title, strnlen(header->title, 15));
+    std::replace_if(entry.title.begin(), entry.title.end(), [](unsigned char c) { return c < 0x20; }, '?');
+    entry.cartridge_type = header->cartridge_type;
+
+    std::uint8_t checksum = 0;
+    for (std::uint16_t i=0x0134; i<=0x014C; i++)
+    {
+        checksum = checksum - rom[i] - 1;
+    }
+    entry.header_valid = checksum == header->header_checksum;
+
+    return entry;
+}
+
+RomLibrary::RomLibrary(const std::string &index_file)
+    : index_file(index_file)
+    , cache_directory(index_file + ".cache")
+{
+    load();
+}
+
+// One tab separated line per ROM, the path last since it may contain anything but newlines
+void RomLibrary::load()
+{
+    std::ifstream in(index_file);
+    std::string line;
+    if ( ! std::getline(in, line) || line != INDEX_MAGIC)
+    {
+        return;
+    }
+
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        RomLibraryEntry entry;
+        std::string crc, digest;
+        int header_valid, type;
+        fields >> entry.size >> entry.mtime >> header_valid >> type >> crc >> digest;
+        fields.ignore(1);
+        std::getline(fields, entry.image, '\t');
+        std::getline(fields, entry.title, '\t');
+        std::getline(fields, entry.path);
+
+        if ( ! fields || digest.size() != 40)
+        {
+            continue;
+        }
+
+        entry.header_valid = header_valid;
+        entry.cartridge_type = type;
+        entry.crc32 = std::stoul(crc, nullptr, 16);
+        for (std::size_t i=0; i<entry.sha1.size(); ++i)
+        {
+            entry.sha1[i] = std::stoul(digest.substr(2*i, 2), nullptr, 16);
+        }
+        entries[entry.path] = entry;
+    }
+}
+
+void RomLibrary::save() const
+{
+    const auto temp_name = index_file + ".tmp";
+    {
+        std::ofstream out(temp_name);
+        out << INDEX_MAGIC << "\n";
+        for (const auto &[path, entry] : entries)
+        {
+            out << entry.size << "\t" << entry.mtime << "\t" << entry.header_valid << "\t" << int(entry.cartridge_type)
+                << "\t" << std::hex << std::setw(8) << std::setfill('0') << entry.crc32 << std::dec
+                << "\t" << to_hex(entry.sha1.data(), entry.sha1.size())
+                << "\t" << entry.image << "\t" << entry.title << "\t" << path << "\n";
+        }
+        if ( ! out)
+        {
+            throw std::runtime_error("Unable to write file: " + temp_name);
+        }
+    }
+    fs::rename(temp_name, index_file);
+}
+
+std::size_t RomLibrary::scan(const std::string &directory, unsigned jobs)
+{
+    std::vector<std::string> stale;
+    std::map<std::string, RomLibraryEntry> current;
+    //The inflated copies sit next to the index, usually inside the directory
+    const auto cache = index_key(cache_directory);
+    for (auto it = fs::recursive_directory_iterator(directory); it != fs::recursive_directory_iterator(); ++it)
+    {
+        const auto &file = *it;
+        if (file.is_directory() && index_key(file.path()) == cache)
+        {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if ( ! file.is_regular_file() || ! is_rom_file(file.path()))
+        {
+            continue;
+        }
+
+        const auto path = index_key(file.path());
+        auto known = entries.find(path);
+        if (known != entries.end() && known->second.size == file.file_size() && known->second.mtime == modification_time(file.path()))
+        {
+            current[path] = known->second;
+        }
+        else
+        {
+            stale.push_back(path);
+        }
+    }
+
+    //Files that went away drop out of the index, entries of other directories stay
+    const auto root = (fs::path(index_key(directory)) / "").string();
+    for (auto it = entries.begin(); it != entries.end(); )
+    {
+        const bool below = it->first.compare(0, root.size(), root) == 0;
+        it = below ? entries.erase(it) : std::next(it);
+    }
+    entries.merge(current);
+
+    jobs = jobs ? jobs : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<unsigned>(jobs, std::max<std::size_t>(1, stale.size()));
+
+    std::vector<RomLibraryEntry> scanned(stale.size());
+    std::vector<char> readable(stale.size(), false);
+    std::atomic<std::size_t> next_file { 0 };
+
+    std::vector<std::thread> workers;
+    for (unsigned i=0; i<jobs; ++i)
+    {
+        workers.emplace_back([&]
+        {
+            for (auto n = next_file++; n < stale.size(); n = next_file++)
+            {
+                try
+                {
+                    scanned[n] = read_rom_library_entry(stale[n], cache_directory);
+                    readable[n] = true;
+                }
+                catch (std::exception const &e)
+                {
+                    std::cerr << stale[n] << ": " << e.what() << std::endl;
+                }
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    for (std::size_t n=0; n<stale.size(); ++n)
+    {
+        if (readable[n])
+        {
+            entries[stale[n]] = std::move(scanned[n]);
+        }
+    }
+    return stale.size();
+}
+
+std::vector<const RomLibraryEntry *> RomLibrary::find(const std::string &query) const
+{
+    auto lower = [](std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+        return text;
+    };
+    const auto needle = lower(query);
+
+    std::vector<const RomLibraryEntry *> found;
+    for (const auto &[path, entry] : entries)
+    {
+        std::ostringstream crc;
+        crc << std::hex << std::setw(8) << std::setfill('0') << entry.crc32;
+
+        if (needle.empty()
+            || lower(entry.title).find(needle) != std::string::npos
+            || lower(path).find(needle) != std::string::npos
+            || crc.str().find(needle) != std::string::npos
+            || to_hex(entry.sha1.data(), entry.sha1.size()).find(needle) != std::string::npos)
+        {
+            found.push_back(&entry);
+        }
+    }
+    return found;
+}
+
+std::string RomLibrary::resolve(const std::string &rom_file) const
+{
+    std::error_code error;
+    auto entry = entries.find(index_key(rom_file));
+    if (entry == entries.end() || entry->second.image.empty()
+        || entry->second.size != fs::file_size(rom_file, error)
+        || entry->second.mtime != fs::last_write_time(rom_file, error).time_since_epoch().count()
+        || ! fs::exists(entry->second.image, error))
+    {
+        return rom_file;
+    }
+    return entry->second.image;
+}
+
+int run_rom_library(const RomLibraryOptions &options)
+{
+    const auto index_file = options.index_file.empty()
+        ? (fs::path(options.directory) / "gb-library.index").string()
+        : options.index_file;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    RomLibrary library(index_file);
+    const auto scanned = library.scan(options.directory, options.jobs);
+    library.save();
+
+    const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+
+    const auto found = library.find(options.query);
+
+    std::size_t name_width = 3;
+    for (auto entry : found)
+    {
+        name_width = std::max(name_width, fs::relative(entry->path, options.directory).string().size());
+    }
+
+    std::cout << std::left << std::setw(name_width) << "ROM" << "  " << std::setw(15) << "TITLE" << "  "
+              << std::setw(24) << "TYPE" << "  " << std::setw(8) << "CRC32" << "  " << std::setw(40) << "SHA-1" << "  HEADER\n";
+
+    for (auto entry : found)
+    {
+        CartridgeHeader header = {};
+        header.cartridge_type = entry->cartridge_type;
+        const char *type = cartridge_type(&header);
+
+        std::cout << std::left << std::setw(name_width) << fs::relative(entry->path, options.directory).string()
+                  << "  " << std::setw(15) << entry->title
+                  << "  " << std::setw(24) << (type ? type : "UNKNOWN")
+                  << "  " << std::right << std::hex << std::setw(8) << std::setfill('0') << entry->crc32 << std::dec << std::setfill(' ')
+                  << "  " << to_hex(entry->sha1.data(), entry->sha1.size())
+                  << "  " << (entry->header_valid ? "OK" : "BAD") << "\n";
+    }
+
+    std::cout << found.size() << " of " << library.entries.size() << " ROMs listed, " << scanned << " read in "
+              << std::fixed << std::setprecision(2) << wall_time.count() << " s" << std::endl;
+
+    return EXIT_SUCCESS;
+}
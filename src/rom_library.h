@@ -0,0 +1,67 @@
+#pragma once
+
+#include "checksums.h"
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+struct RomLibraryOptions
+{
+    std::string directory;
+    // Defaults to gb-library.index inside directory
+    std::string index_file;
+    // Only list entries whose title, path, CRC-32 or SHA-1 contains this
+    std::string query;
+    // 0 uses every hardware thread
+    unsigned jobs = 0;
+};
+
+struct RomLibraryEntry
+{
+    std::string path;
+    std::uint64_t size = 0;
+    std::int64_t mtime = 0;
+
+    bool header_valid = false;
+    std::string title;
+    std::uint8_t cartridge_type = 0;
+    std::uint32_t crc32 = 0;
+    Sha1 sha1 = {};
+
+    // Decompressed copy of a .gz or .zip ROM, empty for plain ones
+    std::string image;
+};
+
+// Header and checksum index of every ROM below a directory. Files whose size
+// and modification time match the persisted index are not read again.
+class RomLibrary
+{
+public:
+    explicit RomLibrary(const std::string &index_file);
+
+    /// Brings the index up to date with directory, returns how many files had to be read
+    std::size_t scan(const std::string &directory, unsigned jobs);
+    void save() const;
+
+    std::vector<const RomLibraryEntry *> find(const std::string &query) const;
+
+    /// The decompressed copy of a compressed ROM the index is up to date on, otherwise rom_file itself
+    std::string resolve(const std::string &rom_file) const;
+
+    // Keyed by path
+    std::map<std::string, RomLibraryEntry> entries;
+
+private:
+    std::string index_file;
+    // Decompressed images, named after their SHA-1
+    std::string cache_directory;
+
+    void load();
+};
+
+RomLibraryEntry read_rom_library_entry(const std::string &path, const std::string &cache_directory);
+
+// Scans options.directory in parallel, updates the index and prints the matching entries
+int run_rom_library(const RomLibraryOptions &options);
@@ -0,0 +1,320 @@
+#include "rom_patch.h"
+
+#include "checksums.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Same limit as for archives, guards against a corrupt size field
+static const std::size_t MAX_ROM_SIZE = 64 << 20;
+
+namespace
+{
+    struct PatchReader
+    {
+        const std::uint8_t *data;
+        std::size_t size;
+        std::size_t position;
+        const std::string &filename;
+
+        void need(std::size_t count) const
+        {
+            if (count > size - position)
+            {
+                throw std::runtime_error("Corrupt or truncated patch: " + filename);
+            }
+        }
+
+        std::uint8_t byte()
+        {
+            need(1);
+            return data[position++];
+        }
+
+        const std::uint8_t *bytes(std::size_t count)
+        {
+            need(count);
+            position += count;
+            return data + position - count;
+        }
+
+        std::uint32_t big_endian(int count)
+        {
+            std::uint32_t value = 0;
+            while (count--)
+            {
+                value = value << 8 | byte();
+            }
+            return value;
+        }
+
+        // BPS variable-length number: 7 bits per byte, the last byte has the top bit set
+        std::uint64_t number()
+        {
+            std::uint64_t value = 0;
+            std::uint64_t shift = 1;
+            for (;;)
+            {
+                const std::uint8_t x = byte();
+                value += (x & 0x7F) * shift;
+                if (x & 0x80)
+                {
+                    return value;
+                }
+                shift <<= 7;
+                value += shift;
+                if (shift > MAX_ROM_SIZE << 8)
+                {
+                    throw std::runtime_error("Corrupt or truncated patch: " + filename);
+                }
+            }
+        }
+    };
+}
+
+static bool is_ips(const std::uint8_t *patch, std::size_t patch_size)
+{
+    return patch_size >= 8 && std::memcmp(patch, "PATCH", 5) == 0;
+}
+
+static bool is_bps(const std::uint8_t *patch, std::size_t patch_size)
+{
+    return patch_size >= 19 && std::memcmp(patch, "BPS1", 4) == 0;
+}
+
+static std::uint32_t read32(const std::uint8_t *data)
+{
+    return data[0] | data[1] << 8 | data[2] << 16 | std::uint32_t(data[3]) << 24;
+}
+
+static bool is_ips_end(const PatchReader &in)
+{
+    return in.size - in.position >= 3 && std::memcmp(in.data + in.position, "EOF", 3) == 0;
+}
+
+// Records are a 24-bit offset and 16-bit length followed by the data, or by a 16-bit
+// count and the byte to repeat when the length is 0. "EOF" ends the list, optionally
+// followed by the 24-bit size to truncate the ROM to.
+static std::size_t ips_size(const std::uint8_t *patch, std::size_t patch_size, std::size_t source_size, const std::string &filename)
+{
+    PatchReader in{ patch, patch_size, 5, filename };
+    std::size_t size = source_size;
+
+    while ( ! is_ips_end(in))
+    {
+        const std::size_t offset = in.big_endian(3);
+        std::size_t length = in.big_endian(2);
+        if (length)
+        {
+            in.bytes(length);
+        }
+        else
+        {
+            length = in.big_endian(2);
+            in.byte();
+        }
+        size = std::max(size, offset + length);
+    }
+
+    in.bytes(3);
+    if (patch_size - in.position >= 3)
+    {
+        size = in.big_endian(3);
+    }
+    return size;
+}
+
+static void apply_ips(const std::uint8_t *patch, std::size_t patch_size, std::uint8_t *target, std::size_t target_size, const std::string &filename)
+{
+    PatchReader in{ patch, patch_size, 5, filename };
+
+    auto write = [&](std::size_t offset, std::uint8_t value)
+    {
+        //Past a truncation point the record has no effect
+        if (offset < target_size && target[offset] != value)
+        {
+            target[offset] = value;
+        }
+    };
+
+    while ( ! is_ips_end(in))
+    {
+        const std::size_t offset = in.big_endian(3);
+        const std::size_t length = in.big_endian(2);
+        if (length)
+        {
+            const std::uint8_t *data = in.bytes(length);
+            for (std::size_t i=0; i<length; ++i)
+            {
+                write(offset + i, data[i]);
+            }
+        }
+        else
+        {
+            const std::size_t count = in.big_endian(2);
+            const std::uint8_t value = in.byte();
+            for (std::size_t i=0; i<count; ++i)
+            {
+                write(offset + i, value);
+            }
+        }
+    }
+}
+
+// "BPS1", source size, target size, metadata, then actions up to a footer of the
+// source, target and patch CRC-32s
+static std::size_t bps_size(const std::uint8_t *patch, std::size_t patch_size, const std::uint8_t *source, std::size_t source_size, const std::string &filename)
+{
+    const std::uint8_t *footer = patch + patch_size - 12;
+    if (crc32(patch, patch_size - 4) != read32(footer + 8))
+    {
+        throw std::runtime_error("Corrupt or truncated patch: " + filename);
+    }
+
+    PatchReader in{ patch, patch_size - 12, 4, filename };
+    const std::uint64_t expected_source_size = in.number();
+    const std::uint64_t size = in.number();
+    if (expected_source_size != source_size || crc32(source, source_size) != read32(footer))
+    {
+        throw std::runtime_error("Patch was made for a different ROM: " + filename);
+    }
+    return size;
+}
+
+static void apply_bps(const std::uint8_t *patch, std::size_t patch_size, const std::uint8_t *source, std::size_t source_size,
+                      std::uint8_t *target, std::size_t target_size, const std::string &filename)
+{
+    PatchReader in{ patch, patch_size - 12, 4, filename };
+    in.number();
+    in.number();
+    in.bytes(in.number());
+
+    auto corrupt = [&]()
+    {
+        return std::runtime_error("Corrupt or truncated patch: " + filename);
+    };
+
+    auto relative = [&](std::size_t &offset)
+    {
+        const std::uint64_t data = in.number();
+        offset += (data & 1) ? -std::size_t(data >> 1) : std::size_t(data >> 1);
+    };
+
+    std::size_t output = 0;
+    std::size_t source_offset = 0;
+    std::size_t target_offset = 0;
+
+    while (in.position < in.size)
+    {
+        const std::uint64_t action = in.number();
+        const std::size_t length = (action >> 2) + 1;
+        if (length > target_size - output)
+        {
+            throw corrupt();
+        }
+
+        switch (action & 3)
+        {
+            //SourceRead: the target already holds the source at the same offset
+            case 0:
+                if (output + length > source_size)
+                {
+                    throw corrupt();
+                }
+                break;
+
+            //TargetRead
+            case 1:
+            {
+                const std::uint8_t *data = in.bytes(length);
+                for (std::size_t i=0; i<length; ++i)
+                {
+                    if (target[output + i] != data[i])
+                    {
+                        target[output + i] = data[i];
+                    }
+                }
+                break;
+            }
+
+            //SourceCopy
+            case 2:
+                relative(source_offset);
+                if (source_offset > source_size || length > source_size - source_offset)
+                {
+                    throw corrupt();
+                }
+                for (std::size_t i=0; i<length; ++i)
+                {
+                    if (target[output + i] != source[source_offset + i])
+                    {
+                        target[output + i] = source[source_offset + i];
+                    }
+                }
+                source_offset += length;
+                break;
+
+            //TargetCopy: byte by byte, the ranges may overlap to repeat a pattern
+            case 3:
+                relative(target_offset);
+                if (target_offset >= output)
+                {
+                    throw corrupt();
+                }
+                for (std::size_t i=0; i<length; ++i)
+                {
+                    if (target[output + i] != target[target_offset + i])
+                    {
+                        target[output + i] = target[target_offset + i];
+                    }
+                }
+                target_offset += length;
+                break;
+        }
+        output += length;
+    }
+
+    if (crc32(target, target_size) != read32(patch + patch_size - 8))
+    {
+        throw std::runtime_error("Patched ROM does not match the checksum in: " + filename);
+    }
+}
+
+std::size_t patched_rom_size(const std::uint8_t *patch, std::size_t patch_size,
+                             const std::uint8_t *source, std::size_t source_size, const std::string &filename)
+{
+    std::size_t size;
+    if (is_ips(patch, patch_size))
+    {
+        size = ips_size(patch, patch_size, source_size, filename);
+    }
+    else if (is_bps(patch, patch_size))
+    {
+        size = bps_size(patch, patch_size, source, source_size, filename);
+    }
+    else
+    {
+        throw std::runtime_error("Not an IPS or BPS patch: " + filename);
+    }
+
+    if (size > MAX_ROM_SIZE)
+    {
+        throw std::runtime_error("Corrupt or truncated patch: " + filename);
+    }
+    return size;
+}
+
+void apply_rom_patch(const std::uint8_t *patch, std::size_t patch_size,
+                     const std::uint8_t *source, std::size_t source_size,
+                     std::uint8_t *target, std::size_t target_size, const std::string &filename)
+{
+    if (is_ips(patch, patch_size))
+    {
+        apply_ips(patch, patch_size, target, target_size, filename);
+    }
+    else
+    {
+        apply_bps(patch, patch_size, source, source_size, target, target_size, filename);
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Size of the ROM the patch produces from a source of source_size bytes, checking the
+// patch's own checksum and, for BPS, that it was made for this source
+std::size_t patched_rom_size(const std::uint8_t *patch, std::size_t patch_size,
+                             const std::uint8_t *source, std::size_t source_size, const std::string &filename);
+
+// target starts out as a copy of source, zero past its end, and is target_size bytes long.
+// Only bytes the patch actually changes get written, so the untouched pages of a
+// copy-on-write mapping stay shared with the source.
+void apply_rom_patch(const std::uint8_t *patch, std::size_t patch_size,
+                     const std::uint8_t *source, std::size_t source_size,
+                     std::uint8_t *target, std::size_t target_size, const std::string &filename);
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Flat snapshot of the emulated machine. Every component lists its fields
+// once in serialize(), which either appends them to data or restores them
+// from it, depending on how the snapshot was started.
+class SaveState
+{
+public:
+    std::vector<std::uint8_t> data;
+
+    void begin_save()
+    {
+        data.clear();
+        offset = 0;
+        loading = false;
+    }
+
+    void begin_load()
+    {
+        begin_load(data.data(), data.size());
+    }
+
+    // Loads from memory owned by the caller, such as a mapped file
+    void begin_load(const std::uint8_t *input, std::size_t size)
+    {
+        source = input;
+        source_size = size;
+        offset = 0;
+        loading = true;
+    }
+
+    bool is_loading() const { return loading; }
+
+    // FNV-1a over the snapshot, for comparing machines
+    std::uint64_t hash() const
+    {
+        std::uint64_t hash = 0xcbf29ce484222325ull;
+        for (auto byte : data)
+        {
+            hash = (hash ^ byte) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    void bytes(void *ptr, std::size_t size)
+    {
+        if (loading)
+        {
+            if (offset + size > source_size)
+            {
+                throw std::runtime_error("Save state is truncated");
+            }
+            std::memcpy(ptr, source + offset, size);
+        }
+        else
+        {
+            data.resize(offset + size);
+            std::memcpy(data.data() + offset, ptr, size);
+        }
+        offset += size;
+    }
+
+    template<typename T>
+    SaveState &operator()(T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        bytes(&value, sizeof(T));
+        return *this;
+    }
+
+private:
+    const std::uint8_t *source = nullptr;
+    std::size_t source_size = 0;
+    std::size_t offset = 0;
+    bool loading = false;
+};
@@ -0,0 +1,81 @@
+#include "serial.h"
+#include "save_state.h"
+
+std::uint8_t Serial::read(std::uint16_t address)
+{
+    if (address == 0xFF01) return data;
+    if (address == 0xFF02) return control | 0x7E;
+
+    return 0xFF;
+}
+
+void Serial::write(std::uint16_t address, std::uint8_t value)
+{
+    if (address == 0xFF01)
+    {
+        data = value;
+    }
+
+    if (address == 0xFF02)
+    {
+        control = value & 0x81;
+
+        const bool start = value & 0x80;
+        const bool internal_clock = value & 0x01;
+        transfer_ticks = start && internal_clock ? TRANSFER_TICKS : 0;
+    }
+}
+
+void Serial::run_once()
+{
+    if (link && --poll_ticks == 0)
+    {
+        poll_ticks = POLL_TICKS;
+        link->poll(*this);
+    }
+
+    if (transfer_ticks > 0 && --transfer_ticks == 0)
+    {
+        if (defer_completion)
+        {
+            completion_pending = true;
+            return;
+        }
+        complete_transfer();
+    }
+}
+
+void Serial::complete_transfer()
+{
+    completion_pending = false;
+
+    if (output)
+    {
+        *output += char(data);
+    }
+
+    //With nothing plugged in the line floats high
+    data = link ? link->exchange(*this, data) : 0xFF;
+    control &= ~0x80;
+    interrupts.trigger_interrupt(Interrupts::SERIAL);
+}
+
+std::uint8_t Serial::external_transfer(std::uint8_t in)
+{
+    const bool waiting = (control & 0x81) == 0x80;
+    if ( ! waiting)
+    {
+        return 0xFF;
+    }
+
+    const auto out = data;
+    data = in;
+    control &= ~0x80;
+    interrupts.trigger_interrupt(Interrupts::SERIAL);
+    return out;
+}
+
+void Serial::serialize(SaveState &state)
+{
+    state(data)(control)(transfer_ticks)(completion_pending)(poll_ticks);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "interrupts.h"
+
+#include <string>
+
+class SaveState;
+struct Serial;
+
+// The other end of the link cable. exchange() is called by the side driving the
+// clock when its transfer completes, and returns the byte shifted in from the peer.
+struct LinkPort
+{
+    virtual std::uint8_t exchange(Serial &serial, std::uint8_t data) = 0;
+    virtual void poll(Serial &) {}
+    virtual ~LinkPort() = default;
+};
+
+struct Serial
+{
+    // 8 bits at 8192 Hz
+    static const int TRANSFER_TICKS = 8 * 512;
+    static const int POLL_TICKS = 512;
+
+    Interrupts &interrupts;
+
+    // 0xFF01 SB - Serial transfer data
+    std::uint8_t data = 0;
+    // 0xFF02 SC - Serial transfer control
+    std::uint8_t control = 0;
+
+    LinkPort *link = nullptr;
+    // Receives every byte sent with the internal clock, when set
+    std::string *output = nullptr;
+
+    // Ticks left on a transfer driven by our internal clock
+    int transfer_ticks = 0;
+    // Set when the transfer finished but a cable driver still has to complete it
+    bool completion_pending = false;
+    bool defer_completion = false;
+    int poll_ticks = POLL_TICKS;
+
+    std::uint8_t read(std::uint16_t address);
+    void write(std::uint16_t address, std::uint8_t value);
+
+    void run_once();
+
+    void complete_transfer();
+    std::uint8_t external_transfer(std::uint8_t in);
+
+    void serialize(SaveState &state);
+};
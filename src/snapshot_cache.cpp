@@ -0,0 +1,141 @@
+#include "snapshot_cache.h"
+
+#include "system.h"
+#include "save_state.h"
+#include "checksums.h"
+#include "mapped_file.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    const std::uint32_t MAGIC = 0x43534247; //"GBSC"
+    const std::uint32_t VERSION = 5;
+
+    struct SnapshotHeader
+    {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint8_t sha1[20];
+        std::uint32_t crc32;
+        std::uint64_t warm_frames;
+        std::uint64_t state_size;
+    };
+}
+
+SnapshotCache::SnapshotCache(const std::string &directory) : directory(directory)
+{
+}
+
+// The header's global checksum is cheap to read and tells most ROMs apart,
+// so a miss is found without hashing the whole ROM
+std::string SnapshotCache::checksum_prefix(const System &system) const
+{
+    return to_hex(&(*system.cart.rom_image)[0x14E], 2) + "-";
+}
+
+std::string SnapshotCache::filename(const System &system, const Sha1 &digest, std::uint64_t warm_frames) const
+{
+    const auto battery = battery_key.empty() ? "" : "-" + battery_key;
+    return directory + "/" + checksum_prefix(system) + to_hex(digest.data(), digest.size()) + battery
+         + "-" + std::to_string(warm_frames) + ".snapshot";
+}
+
+bool SnapshotCache::load(System &system, std::uint64_t warm_frames)
+{
+    //The snapshot carries the cartridge RAM, a different save file makes it a different start
+    if (has_battery(system.cart.header))
+    {
+        const auto image = system.cart.battery_image();
+        const auto digest = sha1(image.data(), image.size());
+        battery_key = to_hex(digest.data(), digest.size());
+    }
+
+    std::error_code error;
+    const auto prefix = checksum_prefix(system);
+    bool candidate = false;
+    for (const auto &entry : fs::directory_iterator(directory, error))
+    {
+        if (entry.path().filename().string().compare(0, prefix.size(), prefix) == 0)
+        {
+            candidate = true;
+            break;
+        }
+    }
+    if ( ! candidate)
+    {
+        return false;
+    }
+
+    const auto &rom = *system.cart.rom_image;
+    const auto digest = sha1(rom.data(), rom.size());
+    const auto name = filename(system, digest, warm_frames);
+    if ( ! fs::exists(name, error))
+    {
+        return false;
+    }
+
+    MappedFile file(name);
+    if (file.size() < sizeof(SnapshotHeader))
+    {
+        return false;
+    }
+
+    SnapshotHeader header;
+    std::memcpy(&header, file.data(), sizeof header);
+    if (header.magic != MAGIC || header.version != VERSION || header.warm_frames != warm_frames
+        || std::memcmp(header.sha1, digest.data(), digest.size()) != 0
+        || header.state_size != file.size() - sizeof header)
+    {
+        return false;
+    }
+
+    const auto *state_data = file.data() + sizeof header;
+    if (crc32(state_data, header.state_size) != header.crc32)
+    {
+        return false;
+    }
+
+    SaveState state;
+    state.begin_load(state_data, header.state_size);
+    system.serialize(state);
+    return true;
+}
+
+void SnapshotCache::store(System &system, std::uint64_t warm_frames)
+{
+    SaveState state;
+    state.begin_save();
+    system.serialize(state);
+
+    const auto &rom = *system.cart.rom_image;
+    const auto digest = sha1(rom.data(), rom.size());
+
+    SnapshotHeader header = {};
+    header.magic = MAGIC;
+    header.version = VERSION;
+    std::memcpy(header.sha1, digest.data(), digest.size());
+    header.crc32 = crc32(state.data.data(), state.data.size());
+    header.warm_frames = warm_frames;
+    header.state_size = state.data.size();
+
+    fs::create_directories(directory);
+
+    //Write then rename, so a concurrent or interrupted run never sees half a snapshot
+    const auto name = filename(system, digest, warm_frames);
+    const auto temp_name = name + ".tmp";
+    {
+        std::ofstream file(temp_name, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof header);
+        file.write(reinterpret_cast<const char *>(state.data.data()), state.data.size());
+        if ( ! file)
+        {
+            throw std::runtime_error("Unable to write snapshot: " + temp_name);
+        }
+    }
+    fs::rename(temp_name, name);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "checksums.h"
+
+#include <cstdint>
+#include <string>
+
+class System;
+
+// On-disk cache of machine snapshots taken a fixed number of frames after
+// power on, keyed by the SHA-1 of the ROM and of the battery RAM it was
+// started with. Starting from a cached snapshot skips the boot sequence and
+// any intro the game runs during those frames.
+class SnapshotCache
+{
+public:
+    explicit SnapshotCache(const std::string &directory);
+
+    /// Restores the snapshot for the loaded ROM, false when there is none
+    bool load(System &system, std::uint64_t warm_frames);
+    /// Writes the current state of system as the snapshot for its ROM and the
+    /// battery RAM load() saw, so call it on a system load() turned down
+    void store(System &system, std::uint64_t warm_frames);
+
+private:
+    std::string directory;
+    // Of the battery RAM at power on, empty for carts without a battery
+    std::string battery_key;
+
+    std::string checksum_prefix(const System &system) const;
+    std::string filename(const System &system, const Sha1 &digest, std::uint64_t warm_frames) const;
+};
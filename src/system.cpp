@@ -1,44 +1,157 @@
 #include "system.h"
+#include "save_state.h"
+#include "recompiled.h"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
-System::System(const std::string &cartridge_filename)
+System::System(const std::string &cartridge_filename, bool print_header, const std::string &patch_file, bool battery_file)
     : timer{ interrupts }
-    , cart(cartridge_filename)
-    , bus{ interrupts, timer, ppu, cart }
+    , serial{ interrupts }
+    , cart(cartridge_filename, patch_file, battery_file)
+    , bus{ interrupts, timer, serial, ppu, apu, cart }
     , cpu{ bus }
     , ppu{ bus }
 {
-    std::cout << "Title    : " << cart.header->title  << std::endl;
+    cart.mbc->clock = &clock;
+    recompiled = find_recompiled_rom(*cart.rom_image);
+
+    power_on_state.begin_save();
+    serialize(power_on_state);
+
+    if ( ! print_header)
+    {
+        return;
+    }
+
+    std::cout << "Title    : " << cart.title()  << std::endl;
     std::cout << "Type     : " << int(cart.header->cartridge_type) << ": " << cartridge_type(cart.header) << std::endl;
     std::cout << "ROM Size : " << (32 << cart.header->rom_size) << " KBytes"  << std::endl;
     std::cout << "RAM Size : " << int(cart.header->ram_size) << std::endl;
-    std::cout << "Cart Size : " << (cart.rom_data.size()) << " Bytes"  << std::endl;
+    std::cout << "Cart Size : " << (cart.rom_image->size()) << " Bytes"  << std::endl;
+    if (recompiled)
+    {
+        std::cout << "Recompiled code available" << std::endl;
+    }
 }
 
-void System::tick()
+std::size_t System::tick()
 {
     size_t ticks = 0;
     ticks += cpu.run_interrupts();
+
+    //Blocks run their own peripherals, an interrupt dispatch still goes the usual way
+    if (ticks == 0 && recompiled && ! cpu.halted && ! cpu.trace_instructions)
+    {
+        if (auto block_ticks = run_recompiled())
+        {
+            return block_ticks;
+        }
+    }
+
     ticks += cpu.run_once();
+    run_peripherals(ticks);
+
+    return ticks;
+}
+
+// Runs the translated block at pc, if there is one
+std::size_t System::run_recompiled()
+{
+    const auto pc = cpu.registers.pc;
+    if (pc > 0x7FFF)
+    {
+        return 0;
+    }
+
+    //Blocks were translated for the address range their bank normally shows up in
+    const auto offset = cart.rom_offset(pc);
+    if ((pc <= 0x3FFF) != (offset <= 0x3FFF))
+    {
+        return 0;
+    }
+
+    auto block = recompiled->find_block(offset);
+    return block ? block(*this) : 0;
+}
+
+void System::run_peripherals(std::size_t ticks)
+{
+    clock += ticks;
     for (size_t i=0; i<ticks; ++i)
     {
         bus.timer.run_once();
         ppu.run_ounce();
+        apu.run_once();
+        serial.run_once();
     }
+}
+
+
+void System::reset(bool wipe_cart_ram)
+{
+    //Cartridge RAM is the tail of the snapshot, overwrite it with what should survive
+    auto cart_ram = power_on_state.data.end() - cart.ram_banks.size();
+    if (wipe_cart_ram)
+    {
+        std::fill(cart_ram, power_on_state.data.end(), 0);
+    }
+    else
+    {
+        std::copy(cart.ram_banks.begin(), cart.ram_banks.end(), cart_ram);
+    }
+
+    //Unsaved battery RAM stays unsaved, a wipe alone doesn't overwrite the battery file
+    const bool battery_dirty = cart.mbc->battery_dirty;
+    //So does a cartridge clock, which the snapshot may even have from before it followed the host
+    SaveState powered;
+    powered.begin_save();
+    cart.mbc->serialize_powered(powered);
+
+    power_on_state.begin_load();
+    serialize(power_on_state);
 
+    powered.begin_load();
+    cart.mbc->serialize_powered(powered);
+    cart.mbc->battery_dirty = battery_dirty;
+    ppu.frame_ready = false;
+    apu.samples.clear();
+    serial_output.clear();
+}
 
-//    if (uint8_t serial_control = cpu.bus.read(0xFF02); serial_control & 0x80) {
-//        uint8_t c = cpu.bus.read(0xFF01);
+void System::save_state(SaveState &state)
+{
+    state.begin_save();
+    serialize(state);
+}
 
-//        serial_output += c;
-//        serial_control &= ~0x80;
-//        cpu.bus.write(0xFF02, serial_control);
-//        bus.trigger_interrupt(Bus::InterruptFlag::SERIAL);
-//        if (serial_output.size()% 30 == 0 )
-//        {
-//            serial_output += "\n";
-//        }
-    //    }
+void System::load_state(SaveState &state)
+{
+    state.begin_load();
+    serialize(state);
 }
 
+void System::serialize(SaveState &state)
+{
+    static const std::uint32_t MAGIC = 0x31534247; //GBS1
+
+    auto magic = MAGIC;
+    auto checksum = cart.header->global_checksum;
+    state(magic)(checksum);
+
+    if (magic != MAGIC || checksum != cart.header->global_checksum)
+    {
+        throw std::runtime_error("Save state does not belong to this cartridge");
+    }
+
+    state(clock);
+    interrupts.serialize(state);
+    timer.serialize(state);
+    serial.serialize(state);
+    bus.serialize(state);
+    cpu.serialize(state);
+    ppu.serialize(state);
+    apu.serialize(state);
+    //Last, so the cartridge RAM ends the snapshot; reset() relies on that
+    cart.serialize(state);
+}
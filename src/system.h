@@ -6,21 +6,48 @@
 #include "ppu.h"
 #include "interrupts.h"
 #include "timer.h"
+#include "serial.h"
+#include "apu.h"
+#include "save_state.h"
 #include <list>
+
+struct RecompiledRom;
+
 class System
 {
 public:
     Interrupts interrupts;
     Timer timer;
+    Serial serial;
     Cartridge cart;
     Bus bus;
     Cpu cpu;
     Ppu ppu;
+    Apu apu;
 
     std::string serial_output;
 
-    System(const std::string &cartridge_filename);
+    // Ticks since power on
+    std::uint64_t clock = 0;
+
+    // Ahead of time translated code for this ROM, used while instruction tracing is off
+    const RecompiledRom *recompiled = nullptr;
+
+    System(const std::string &cartridge_filename, bool print_header = true, const std::string &patch_file = "", bool battery_file = true);
+
+    /// Back to the power-on state without reloading the ROM or allocating
+    void reset(bool wipe_cart_ram = false);
+
+    std::size_t tick();
+    void run_peripherals(std::size_t ticks);
+
+    void save_state(SaveState &state);
+    void load_state(SaveState &state);
+    void serialize(SaveState &state);
+
+private:
+    SaveState power_on_state;
 
-    void tick();
+    std::size_t run_recompiled();
 };
 
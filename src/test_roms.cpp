@@ -0,0 +1,179 @@
+#include "test_roms.h"
+
+#include "system.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+static bool mooneye_passed(const CpuRegisters &r)
+{
+    return r.b == 3 && r.c == 5 && r.d == 8 && r.e == 13 && r.h == 21 && r.l == 34;
+}
+
+static bool mooneye_failed(const CpuRegisters &r)
+{
+    return r.b == 0x42 && r.c == 0x42 && r.d == 0x42 && r.e == 0x42 && r.h == 0x42 && r.l == 0x42;
+}
+
+static std::string last_line(const std::string &text)
+{
+    auto end = text.find_last_not_of("\n ");
+    if (end == std::string::npos)
+    {
+        return std::string();
+    }
+    auto start = text.find_last_of('\n', end);
+    start = start == std::string::npos ? 0 : start + 1;
+    return text.substr(start, end - start + 1);
+}
+
+TestRomResult run_test_rom(const std::string &rom_file, std::uint64_t timeout_ticks)
+{
+    TestRomResult result;
+    result.rom_file = rom_file;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    try
+    {
+        //Parallel runs of carts with the same title would share a battery file
+        System system(rom_file, false, "", false);
+        system.cpu.trace_instructions = false;
+        system.serial.output = &system.serial_output;
+
+        std::size_t serial_checked = 0;
+
+        while (result.ticks < timeout_ticks)
+        {
+            result.ticks += system.tick();
+
+            if (system.cpu.software_breakpoint)
+            {
+                system.cpu.software_breakpoint = false;
+
+                if (mooneye_passed(system.cpu.registers))
+                {
+                    result.status = TestRomResult::PASSED;
+                    break;
+                }
+                if (mooneye_failed(system.cpu.registers))
+                {
+                    result.status = TestRomResult::FAILED;
+                    break;
+                }
+            }
+
+            if (system.serial_output.size() != serial_checked)
+            {
+                serial_checked = system.serial_output.size();
+
+                if (system.serial_output.find("Passed") != std::string::npos)
+                {
+                    result.status = TestRomResult::PASSED;
+                    break;
+                }
+                if (system.serial_output.find("Failed") != std::string::npos)
+                {
+                    result.status = TestRomResult::FAILED;
+                    break;
+                }
+            }
+        }
+
+        result.detail = last_line(system.serial_output);
+    }
+    catch (std::exception const &e)
+    {
+        result.status = TestRomResult::ERROR;
+        result.detail = e.what();
+    }
+
+    result.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+static const char *status_str(TestRomResult::Status status)
+{
+    switch (status)
+    {
+        case TestRomResult::PASSED:  return "PASS";
+        case TestRomResult::FAILED:  return "FAIL";
+        case TestRomResult::TIMEOUT: return "TIMEOUT";
+        case TestRomResult::ERROR:   return "ERROR";
+    }
+    return "?";
+}
+
+int run_test_roms(const TestRomOptions &options)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> rom_files;
+    for (const auto &entry : fs::recursive_directory_iterator(options.directory))
+    {
+        const auto extension = entry.path().extension();
+        if (entry.is_regular_file() && (extension == ".gb" || extension == ".gbc"))
+        {
+            rom_files.push_back(entry.path().string());
+        }
+    }
+    std::sort(rom_files.begin(), rom_files.end());
+
+    auto jobs = options.jobs ? options.jobs : std::max(1u, std::thread::hardware_concurrency());
+    jobs = std::min<unsigned>(jobs, std::max<std::size_t>(1, rom_files.size()));
+
+    std::vector<TestRomResult> results(rom_files.size());
+    std::atomic<std::size_t> next_rom { 0 };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (unsigned i=0; i<jobs; ++i)
+    {
+        workers.emplace_back([&]
+        {
+            for (auto n = next_rom++; n < rom_files.size(); n = next_rom++)
+            {
+                results[n] = run_test_rom(rom_files[n], options.timeout_ticks);
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    const std::chrono::duration<double> wall_time = std::chrono::steady_clock::now() - start;
+
+    std::size_t name_width = 3;
+    for (const auto &result : results)
+    {
+        name_width = std::max(name_width, fs::relative(result.rom_file, options.directory).string().size());
+    }
+
+    std::cout << std::left << std::setw(name_width) << "ROM" << "  " << std::setw(7) << "RESULT"
+              << std::right << std::setw(10) << "TIME (ms)" << std::setw(14) << "CYCLES" << "  DETAIL\n";
+
+    std::size_t passed = 0;
+    for (const auto &result : results)
+    {
+        passed += result.status == TestRomResult::PASSED;
+
+        std::cout << std::left << std::setw(name_width) << fs::relative(result.rom_file, options.directory).string()
+                  << "  " << std::setw(7) << status_str(result.status)
+                  << std::right << std::setw(10) << std::fixed << std::setprecision(1) << result.wall_time * 1000
+                  << std::setw(14) << result.ticks
+                  << "  " << result.detail << "\n";
+    }
+
+    std::cout << passed << "/" << results.size() << " passed in "
+              << std::setprecision(2) << wall_time.count() << " s using " << jobs << " threads" << std::endl;
+
+    return passed == results.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
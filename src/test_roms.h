@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+struct TestRomOptions
+{
+    std::string directory;
+    // About two minutes of emulated time
+    std::uint64_t timeout_ticks = 500000000;
+    // 0 uses every hardware thread
+    unsigned jobs = 0;
+};
+
+struct TestRomResult
+{
+    enum Status {
+        PASSED,
+        FAILED,
+        TIMEOUT,
+        ERROR,
+    };
+
+    std::string rom_file;
+    Status status = TIMEOUT;
+    std::string detail;
+    std::uint64_t ticks = 0;
+    double wall_time = 0;
+};
+
+// Runs a single blargg or mooneye style test ROM until it reports a result
+TestRomResult run_test_rom(const std::string &rom_file, std::uint64_t timeout_ticks);
+
+// Runs every ROM under options.directory in parallel and prints a result table
+int run_test_roms(const TestRomOptions &options);
@@ -0,0 +1,92 @@
+#include "threaded_renderer.h"
+
+#include "save_state.h"
+
+ThreadedRenderer::ThreadedRenderer(Ppu &ppu) : shadow(ppu.bus), ppu(ppu)
+{
+    resync();
+    //Carries on with the frames already drawn, so readers see no gap
+    shadow.adopt_frames(ppu);
+
+    thread = std::thread(&ThreadedRenderer::worker_loop, this);
+}
+
+ThreadedRenderer::~ThreadedRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void ThreadedRenderer::finish()
+{
+    //Rarely more than the last line is left by the time this is called
+    const auto target = write_index.load(std::memory_order_relaxed);
+    while (read_index.load(std::memory_order_acquire) != target)
+    {
+        wake_worker();
+        std::this_thread::yield();
+    }
+}
+
+void ThreadedRenderer::resync()
+{
+    finish();
+
+    SaveState state;
+    state.begin_save();
+    ppu.serialize(state);
+    state.begin_load();
+    shadow.serialize(state);
+    shadow.copy_objects(ppu);
+}
+
+void ThreadedRenderer::worker_loop()
+{
+    for (;;)
+    {
+        auto tail = read_index.load(std::memory_order_relaxed);
+        const auto head = write_index.load();
+
+        if (tail == head)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true);
+            wake.wait(lock, [&] { return closing || write_index.load() != tail; });
+            sleeping.store(false);
+
+            if (closing && write_index.load() == tail)
+            {
+                return;
+            }
+            continue;
+        }
+
+        for ( ; tail != head; ++tail)
+        {
+            replay(ring[tail & (CAPACITY - 1)]);
+            read_index.store(tail + 1, std::memory_order_release);
+        }
+    }
+}
+
+void ThreadedRenderer::replay(const Entry &entry)
+{
+    shadow.line_y = entry.line;
+    shadow.line_tick = entry.tick;
+
+    switch (entry.command)
+    {
+        case REGISTER: shadow.write(entry.address, entry.value); break;
+        case VRAM: shadow.write_vram(entry.address, entry.value); break;
+        case SCAN_OAM: shadow.scan_oam(); break;
+        case RENDER_LINE:
+            shadow.render_current_scanline();
+            shadow.write_output_line();
+            break;
+        case END_FRAME: shadow.swap_frame_buffers(); break;
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "ppu.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Draws a PPU's lines on a worker thread. The emulation thread only appends
+// what happened to a single producer, single consumer ring: register, OAM and
+// VRAM writes and the points at which lines were scanned and drawn. The worker
+// replays that onto a shadow PPU, which then draws each line from exactly the
+// state the real one had when it got there.
+class ThreadedRenderer
+{
+public:
+    enum Command : std::uint8_t {
+        REGISTER,    // Ppu::write, registers FF40-FF4B and OAM
+        VRAM,        // Ppu::write_vram
+        SCAN_OAM,    // mode 2 of line
+        RENDER_LINE, // mode 3 of line
+        END_FRAME,   // VBlank of a drawn frame
+    };
+
+    // Tagged with where the beam was, which is what orders it against the lines
+    struct Entry
+    {
+        Command command;
+        std::uint8_t line;
+        std::uint8_t value;
+        std::uint16_t address;
+        std::uint16_t tick;
+    };
+
+    explicit ThreadedRenderer(Ppu &ppu);
+    ~ThreadedRenderer();
+
+    void log(Command command, std::uint16_t address = 0, std::uint8_t value = 0)
+    {
+        const auto head = write_index.load(std::memory_order_relaxed);
+        while (head - read_index.load(std::memory_order_acquire) == CAPACITY)
+        {
+            wake_worker();
+            std::this_thread::yield();
+        }
+
+        ring[head & (CAPACITY - 1)] = Entry{ command, ppu.line_y, value, address, std::uint16_t(ppu.line_tick) };
+        write_index.store(head + 1);
+
+        //Waking the worker costs more than drawing a line, so it gets them in batches
+        if (command == END_FRAME || (command == RENDER_LINE && ppu.line_y % LINES_PER_WAKE == LINES_PER_WAKE - 1))
+        {
+            wake_worker();
+        }
+    }
+
+    /// Blocks until everything logged so far has been replayed
+    void finish();
+    /// Starts the shadow over from the PPU's current state, after a load
+    void resync();
+
+    // Owns the frame buffers and the output surface while threaded
+    Ppu shadow;
+
+private:
+    static const std::size_t CAPACITY = 1 << 16;
+    static const int LINES_PER_WAKE = 16;
+
+    void wake_worker()
+    {
+        if (sleeping.load())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake.notify_one();
+        }
+    }
+
+    void worker_loop();
+    void replay(const Entry &entry);
+
+    Ppu &ppu;
+    Entry ring[CAPACITY];
+    std::atomic<std::uint64_t> write_index{0};
+    std::atomic<std::uint64_t> read_index{0};
+
+    std::atomic<bool> sleeping{false};
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool closing = false;
+    std::thread thread;
+};
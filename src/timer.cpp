@@ -1,4 +1,5 @@
 #include "timer.h"
+#include "save_state.h"
 
 uint8_t Timer::read(uint16_t address)
 {
@@ -50,3 +51,8 @@ void Timer::run_once()
         interrupts.trigger_interrupt(Interrupts::TIMER);
     }
 }
+
+void Timer::serialize(SaveState &state)
+{
+    state(divider)(counter)(modulo)(control);
+}
@@ -19,4 +19,5 @@ struct Timer
     void write(std::uint16_t address, std::uint8_t value);
 
     void run_once();
+    void serialize(SaveState &state);
 };